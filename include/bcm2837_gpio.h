@@ -0,0 +1,80 @@
+#ifndef _BCM2837_GPIO_H
+#define _BCM2837_GPIO_H
+
+#include <linux/types.h>
+
+// raspberry pi 3のペリフェラルIOの物理アドレス
+#define BCM2837_PERI_BASE   0x3F000000
+#define GPIO_BASE_ADDR      (BCM2837_PERI_BASE + 0x200000)
+
+// GPIO Function Select 0のレジスタ(1つのレジスタで10ピン分)
+#define GPFSEL0             0x00
+
+// GPIO Pin Output Set 0のレジスタ
+#define GPSET0              0x1C
+
+// GPIO Pin Output Clear 0のレジスタ
+#define GPCLR0              0x28
+
+// GPIO Pin Level 0のレジスタ
+#define GPLEV0              0x34
+
+// 確保するメモリサイズ
+#define MEM_SIZE 0x60
+
+// ピン番号の上限
+#define GPIO_NR_PINS        54
+
+// GPFSELnに設定する機能
+#define GPIO_FSEL_INPUT     0x0
+#define GPIO_FSEL_OUTPUT    0x1
+#define GPIO_FSEL_MASK      0x7
+
+// 以下はレジスタのオフセットと値を計算するだけで、レジスタには触れない
+// 読み書きは呼び出し側で行う
+
+// pinの機能を選ぶGPFSELnレジスタのオフセット
+static inline unsigned int gpio_fsel_reg(unsigned int pin)
+{
+    return GPFSEL0 + pin / 10 * 4;
+}
+
+// GPFSELnの値valのうちpinの機能だけをfuncに書き換えた値
+static inline u32 gpio_fsel_val(u32 val, unsigned int pin, u32 func)
+{
+    unsigned int shift = (pin % 10) * 3;
+
+    return (val & ~(GPIO_FSEL_MASK << shift)) | (func << shift);
+}
+
+// pinに対応するGPSETn/GPCLRn/GPLEVnのビット
+static inline u32 gpio_pin_bit(unsigned int pin)
+{
+    return 1U << (pin % 32);
+}
+
+// pinを出力1にするGPSETnレジスタのオフセット
+static inline unsigned int gpio_set_reg(unsigned int pin)
+{
+    return GPSET0 + pin / 32 * 4;
+}
+
+// pinを出力0にするGPCLRnレジスタのオフセット
+static inline unsigned int gpio_clr_reg(unsigned int pin)
+{
+    return GPCLR0 + pin / 32 * 4;
+}
+
+// pinの入力レベルを読むGPLEVnレジスタのオフセット
+static inline unsigned int gpio_lev_reg(unsigned int pin)
+{
+    return GPLEV0 + pin / 32 * 4;
+}
+
+// GPLEVnの値levからpinのレベルを取り出す
+static inline bool gpio_level(u32 lev, unsigned int pin)
+{
+    return (lev & gpio_pin_bit(pin)) != 0;
+}
+
+#endif
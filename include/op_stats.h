@@ -0,0 +1,181 @@
+#ifndef _OP_STATS_H
+#define _OP_STATS_H
+
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/slab.h>
+#include <linux/smp.h>
+#include <linux/cpu.h>
+#include <linux/percpu.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/seq_file.h>
+
+// ファイル操作のレイテンシとエラーのCPUごとの統計(debugfsのstatsファイル)
+// 各CPUは自分の分にだけ書き込み、読み出すときに全CPU分を合計する
+// 操作の番号と名前は呼び出し側が決め、OP_STATS_MAX_OPS個まで数えられる
+
+#define OP_STATS_MAX_OPS    6       // stackのopen/release/read/write/ioctl/uring_cmd
+#define OP_HIST_BUCKETS     32      // ilog2(ナノ秒)ごと。最後のバケットは2^31ナノ秒以上
+#define OP_NR_ERRNO         134     // これ以上のerrnoは最後の要素にまとめて数える
+
+// ファイル操作ごとの統計
+struct op_stat {
+    u64 count;
+    u64 bytes;                      // read/writeで転送したバイト数
+    u64 errors;
+    u64 hist[OP_HIST_BUCKETS];      // レイテンシのlog2ヒストグラム
+};
+
+// CPUごとのファイル操作の統計
+struct op_stats {
+    struct op_stat op[OP_STATS_MAX_OPS];
+    u64 err[OP_NR_ERRNO + 1];       // errnoごとのエラー数
+};
+
+// ファイル操作1回分の統計を自CPUの分に記録する
+// startは操作の開始時刻(ktime_get_ns)、retは操作の戻り値
+// xferがtrueの操作(read/write)は、正の戻り値を転送したバイト数として数える
+static inline void op_stats_record(struct op_stats __percpu *stats, unsigned int op, bool xfer,
+                                   u64 start, ssize_t ret)
+{
+    u64 ns = ktime_get_ns() - start;
+    unsigned int b = ns ? min_t(unsigned int, ilog2(ns), OP_HIST_BUCKETS - 1) : 0;
+
+    this_cpu_inc(stats->op[op].count);
+    this_cpu_inc(stats->op[op].hist[b]);
+    if (ret > 0 && xfer) {
+        this_cpu_add(stats->op[op].bytes, ret);
+    } else if (ret < 0) {
+        this_cpu_inc(stats->op[op].errors);
+        this_cpu_inc(stats->err[min_t(ssize_t, -ret, OP_NR_ERRNO)]);
+    }
+}
+
+// 全CPU分の統計をsumに足し込む(sumは0で初期化しておくこと)
+static inline void op_stats_sum(struct op_stats *sum, struct op_stats __percpu *stats, unsigned int nr_ops)
+{
+    struct op_stats *st;
+    unsigned int i, b;
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        st = per_cpu_ptr(stats, cpu);
+        for (i = 0; i < nr_ops; i++) {
+            sum->op[i].count += READ_ONCE(st->op[i].count);
+            sum->op[i].bytes += READ_ONCE(st->op[i].bytes);
+            sum->op[i].errors += READ_ONCE(st->op[i].errors);
+            for (b = 0; b < OP_HIST_BUCKETS; b++) {
+                sum->op[i].hist[b] += READ_ONCE(st->op[i].hist[b]);
+            }
+        }
+        for (i = 0; i <= OP_NR_ERRNO; i++) {
+            sum->err[i] += READ_ONCE(st->err[i]);
+        }
+    }
+}
+
+// 合計した統計を操作ごとに出力する。namesは操作の番号ごとの名前
+static inline void op_stats_print(struct seq_file *m, const struct op_stats *sum,
+                                  const char * const *names, unsigned int nr_ops)
+{
+    unsigned int i, b;
+
+    for (i = 0; i < nr_ops; i++) {
+        seq_printf(m, "%s count %llu bytes %llu errors %llu\n", names[i],
+                   sum->op[i].count, sum->op[i].bytes, sum->op[i].errors);
+        // 0でないバケットだけを[下限, 上限)ナノ秒で出力する
+        for (b = 0; b < OP_HIST_BUCKETS; b++) {
+            if (sum->op[i].hist[b] == 0) {
+                continue;
+            }
+            if (b == OP_HIST_BUCKETS - 1) {
+                seq_printf(m, "  %llu- ns %llu\n", 1ULL << b, sum->op[i].hist[b]);
+            } else {
+                seq_printf(m, "  %llu-%llu ns %llu\n", b ? 1ULL << b : 0, 1ULL << (b + 1), sum->op[i].hist[b]);
+            }
+        }
+    }
+    for (i = 1; i <= OP_NR_ERRNO; i++) {
+        if (sum->err[i] == 0) {
+            continue;
+        }
+        if (i == OP_NR_ERRNO) {
+            seq_printf(m, "errno %u- %llu\n", i, sum->err[i]);
+        } else {
+            seq_printf(m, "errno %u %llu\n", i, sum->err[i]);
+        }
+    }
+}
+
+// statsファイルのshow関数の本体
+// 全CPU分を読み出したときに合計して出力する
+static inline int op_stats_show(struct seq_file *m, struct op_stats __percpu *stats,
+                                const char * const *names, unsigned int nr_ops)
+{
+    struct op_stats *sum;
+
+    sum = kzalloc(sizeof(*sum), GFP_KERNEL);
+    if (sum == NULL) {
+        return -ENOMEM;
+    }
+    op_stats_sum(sum, stats, nr_ops);
+    op_stats_print(m, sum, names, nr_ops);
+    kfree(sum);
+    return 0;
+}
+
+// op_stats_resetで消す領域(呼び出し側がop_statsを埋め込んだ構造体ごと消せるように大きさも持つ)
+struct op_stats_area {
+    void __percpu *stats;
+    size_t size;
+};
+
+// 自CPUの統計を0に戻す(on_each_cpuからそのCPU上で呼ばれる)
+static inline void op_stats_reset_cpu(void *info)
+{
+    struct op_stats_area *area = info;
+
+    memset(this_cpu_ptr(area->stats), 0, area->size);
+}
+
+// 全CPUの統計を0に戻す
+// オンラインのCPUの分はそのCPU上で消し、オフラインのCPUの分はここで消す
+// 記録中の操作や読み出しとは同期しないので、0に戻すのは近似的なもの:
+// 記録の途中で消された操作はcountだけ・histだけのように一部だけが残ることがあり、
+// 同時に読み出すと、消した後のCPUと消す前のCPUの値が混ざることがある
+static inline void op_stats_reset(void __percpu *stats, size_t size)
+{
+    struct op_stats_area area = { .stats = stats, .size = size };
+    int cpu;
+
+    cpus_read_lock();
+    on_each_cpu(op_stats_reset_cpu, &area, 1);
+    for_each_possible_cpu(cpu) {
+        if (!cpu_online(cpu)) {
+            memset(per_cpu_ptr(stats, cpu), 0, size);
+        }
+    }
+    cpus_read_unlock();
+}
+
+// statsファイルのwrite関数の本体
+// "0"を書き込むとop_stats_resetで全CPUの統計を0に戻す
+static inline ssize_t op_stats_write(const char __user *buf, size_t count, void __percpu *stats, size_t size)
+{
+    unsigned int val;
+    int ret;
+
+    ret = kstrtouint_from_user(buf, count, 0, &val);
+    if (ret != 0) {
+        return ret;
+    }
+    if (val != 0) {
+        return -EINVAL;
+    }
+    op_stats_reset(stats, size);
+    return count;
+}
+
+#endif
@@ -2,87 +2,529 @@
 #include <linux/fs.h>
 #include <linux/platform_device.h>
 #include <linux/ioport.h>
+#include <linux/io.h>
 #include <linux/slab.h>
 #include <linux/string.h>
+#include <linux/jump_label.h>
+#include <linux/percpu.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/cpu.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/atomic.h>
+#include <linux/hrtimer.h>
+#include <linux/mutex.h>
+#include <linux/mm.h>
 #include <asm/io.h>
 
+#define CREATE_TRACE_POINTS
+#include "led_trace.h"
+
+#include "led.h"
+#include "bcm2837_gpio.h"
+#include "op_stats.h"
+
 #define DEV_NAME "led"
 #define LED_MAJOR_NUM 60
 
-// raspberry pi 3のペリフェラルIOの物理アドレス
-#define BCM2837_PERI_BASE   0x3F000000
-#define GPIO_BASE_ADDR      (BCM2837_PERI_BASE + 0x200000)
+// 使用するLEDピン番号(pinsモジュールパラメータを指定しないとき)
+#define LED_PIN             18
+
+// 1つのバンクで扱えるLEDの数
+// GPSET0/GPCLR0の1回ずつの書き込みでバンク全体を更新するので、ピンは0〜31に限る
+#define LED_MAX_PINS        32
 
-// GPIO Function Select 1のレジスタ
-#define GPFSEL1             0x04
+// バンクのi番目のLEDに使うピン番号
+static unsigned int pins[LED_MAX_PINS] = { LED_PIN };
+static int nr_pins = 1;
+module_param_array(pins, uint, &nr_pins, 0444);
+MODULE_PARM_DESC(pins, "GPIO pins (0-31) of the LED bank, bit i of a mask is pins[i]");
 
-// GPIO Pin Output Set 0のレジスタ
-#define GPSET0              0x1C
+// probeでマップしたGPIOレジスタ(デバイスが削除されるまで使い続ける)
+static void __iomem *gpio;
 
-// GPIO Pin Output Clear 0のレジスタ
-#define GPCLR0              0x28
+// simモジュールパラメータを指定したときはPi以外でも動かせるように
+// GPIOレジスタの代わりにメモリ上の疑似レジスタを読み書きする
+static bool sim;
+module_param(sim, bool, 0444);
+MODULE_PARM_DESC(sim, "use simulated GPIO registers instead of the BCM2837 GPIO block");
 
-// 使用するLEDピン番号
-#define LED_PIN             18
+static DEFINE_STATIC_KEY_FALSE(led_sim_key);
+
+// 疑似レジスタ
+// GPSETn/GPCLRnへの書き込みはGPLEVnのビットを立てる/落とす
+static atomic_t led_sim_regs[MEM_SIZE / 4];
+
+// 疑似レジスタに書き込む
+static void led_sim_write(unsigned int off, u32 val)
+{
+    if (off >= GPSET0 && off < GPSET0 + 8) {
+        atomic_or(val, &led_sim_regs[(GPLEV0 + off - GPSET0) / 4]);
+    } else if (off >= GPCLR0 && off < GPCLR0 + 8) {
+        atomic_andnot(val, &led_sim_regs[(GPLEV0 + off - GPCLR0) / 4]);
+    } else {
+        atomic_set(&led_sim_regs[off / 4], val);
+    }
+}
+
+// GPIOレジスタを読む
+static u32 led_reg_read(unsigned int off)
+{
+    if (static_branch_unlikely(&led_sim_key)) {
+        return atomic_read(&led_sim_regs[off / 4]);
+    }
+    return readl(gpio + off);
+}
+
+// GPIOレジスタに書き込む
+static void led_reg_write(unsigned int off, u32 val)
+{
+    if (static_branch_unlikely(&led_sim_key)) {
+        led_sim_write(off, val);
+        return;
+    }
+    writel(val, gpio + off);
+}
+
+// debugモジュールパラメータで有効にしたときだけ出力するデバッグ用のprintk
+// 無効のときはstatic keyで分岐ごと飛ばすのでコストはかからない
+static DEFINE_STATIC_KEY_FALSE(led_debug_key);
+
+#define LED_DBG(fmt, ...)                                       \
+    do {                                                        \
+        if (static_branch_unlikely(&led_debug_key)) {           \
+            printk(DEV_NAME ": " fmt, ##__VA_ARGS__);           \
+        }                                                       \
+    } while (0)
+
+// debugのset関数
+static int led_set_debug(const char *val, const struct kernel_param *kp)
+{
+    bool on;
+    int ret;
 
-// 確保するメモリサイズ
-#define MEM_SIZE 0x60
+    ret = kstrtobool(val, &on);
+    if (ret != 0) {
+        return ret;
+    }
+    if (on) {
+        static_branch_enable(&led_debug_key);
+    } else {
+        static_branch_disable(&led_debug_key);
+    }
+    return 0;
+}
+
+// debugのget関数
+static int led_get_debug(char *buffer, const struct kernel_param *kp)
+{
+    return sprintf(buffer, "%c\n", static_key_enabled(&led_debug_key) ? 'Y' : 'N');
+}
 
-unsigned int *gpio;
+static const struct kernel_param_ops led_debug_ops = {
+    .set = led_set_debug,
+    .get = led_get_debug,
+};
+module_param_cb(debug, &led_debug_ops, NULL, 0644);
+MODULE_PARM_DESC(debug, "print debug messages");
+
+// レイテンシを計測するファイル操作
+enum led_op {
+    LED_OP_OPEN,
+    LED_OP_RELEASE,
+    LED_OP_READ,
+    LED_OP_WRITE,
+    LED_NR_OPS,
+};
+
+static const char * const led_op_names[] = {
+    [LED_OP_OPEN] = "open",
+    [LED_OP_RELEASE] = "release",
+    [LED_OP_READ] = "read",
+    [LED_OP_WRITE] = "write",
+};
+
+// CPUごとのファイル操作の統計
+static DEFINE_PER_CPU(struct op_stats, led_op_stats);
+
+// ファイル操作1回分の統計を自CPUの分に記録する
+// startは操作の開始時刻(ktime_get_ns)、retは操作の戻り値
+static void led_stat_op(enum led_op op, u64 start, ssize_t ret)
+{
+    BUILD_BUG_ON(LED_NR_OPS > OP_STATS_MAX_OPS);
+    op_stats_record(&led_op_stats, op, op == LED_OP_READ || op == LED_OP_WRITE, start, ret);
+}
 
 // openハンドラ
 static int led_open(struct inode *inode, struct file *file)
 {
-    printk("LED Open\n");
+    u64 start = ktime_get_ns();
+
+    trace_led_open(iminor(inode));
+    led_stat_op(LED_OP_OPEN, start, 0);
     return 0;
 }
 
 // releaseハンドラ
 static int led_release(struct inode *inode, struct file *file)
 {
-    printk("LED Release\n");
+    u64 start = ktime_get_ns();
+
+    trace_led_release(iminor(inode));
+    led_stat_op(LED_OP_RELEASE, start, 0);
     return 0;
 }
 
-// writeハンドラ
-static ssize_t led_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
+// バンクのビットマスクをGPSET0/GPCLR0のビットマスクに変換する
+static u32 led_bank_to_gpio(u32 mask)
+{
+    u32 bits = 0;
+    unsigned int i;
+
+    for (i = 0; i < nr_pins; i++) {
+        if (mask & BIT(i)) {
+            bits |= gpio_pin_bit(pins[i]);
+        }
+    }
+    return bits;
+}
+
+// PWMの周期の下限(マイクロ秒)
+// 1周期に2回タイマ割り込みが入るので短くしすぎないようにする
+#define LED_PWM_MIN_PERIOD_US   100
+
+// バンクのLED 1つ分のPWMの状態
+// hrtimerでduty_nsだけ点灯、period_ns - duty_nsだけ消灯を繰り返す
+struct led_pwm {
+    struct hrtimer timer;
+    u32 period_us;
+    u32 duty_us;
+    bool high;          // 点灯している区間か
+};
+
+static struct led_pwm led_pwm[LED_MAX_PINS];
+static DEFINE_MUTEX(led_pwm_lock);  // PWMの開始/停止を直列化する
+static u32 led_pwm_mask;            // PWMで点滅させているLEDのバンクのビット
+
+// PWMのタイマ関数
+// ハードIRQで呼ばれるので、ユーザ空間を介さずにマイクロ秒単位でエッジを出せる
+static enum hrtimer_restart led_pwm_fn(struct hrtimer *timer)
+{
+    struct led_pwm *pwm = container_of(timer, struct led_pwm, timer);
+    unsigned int pin = pins[pwm - led_pwm];
+    u64 on_ns = (u64)pwm->duty_us * NSEC_PER_USEC;
+    u64 off_ns = (u64)(pwm->period_us - pwm->duty_us) * NSEC_PER_USEC;
+
+    pwm->high = !pwm->high;
+    if (pwm->high) {
+        led_reg_write(gpio_set_reg(pin), gpio_pin_bit(pin));
+        hrtimer_forward_now(timer, ns_to_ktime(on_ns));
+    } else {
+        led_reg_write(gpio_clr_reg(pin), gpio_pin_bit(pin));
+        hrtimer_forward_now(timer, ns_to_ktime(off_ns));
+    }
+    return HRTIMER_RESTART;
+}
+
+// バンクのidx番目のLEDのPWMを設定する(led_pwm_lockを取って呼ぶこと)
+// periodが0かdutyが0なら消灯、dutyがperiodと等しければ点灯したままにしてタイマを止める
+static void led_pwm_config(unsigned int idx, u32 period_us, u32 duty_us)
+{
+    struct led_pwm *pwm = &led_pwm[idx];
+    unsigned int pin = pins[idx];
+
+    hrtimer_cancel(&pwm->timer);
+    pwm->period_us = period_us;
+    pwm->duty_us = duty_us;
+    if (period_us == 0 || duty_us == 0 || duty_us == period_us) {
+        WRITE_ONCE(led_pwm_mask, led_pwm_mask & ~BIT(idx));
+        if (period_us != 0 && duty_us == period_us) {
+            led_reg_write(gpio_set_reg(pin), gpio_pin_bit(pin));
+        } else {
+            led_reg_write(gpio_clr_reg(pin), gpio_pin_bit(pin));
+        }
+        return;
+    }
+    // 点灯から始める
+    WRITE_ONCE(led_pwm_mask, led_pwm_mask | BIT(idx));
+    pwm->high = true;
+    led_reg_write(gpio_set_reg(pin), gpio_pin_bit(pin));
+    hrtimer_start(&pwm->timer, ns_to_ktime((u64)duty_us * NSEC_PER_USEC), HRTIMER_MODE_REL_HARD);
+}
+
+// "<idx> <period_us> <duty_us>"を解釈してPWMを設定する
+// writeの"pwm ..."とsysfsのpwmファイルで使う
+static int led_pwm_parse(const char *buf)
+{
+    unsigned int idx;
+    u32 period, duty;
+
+    if (sscanf(buf, "%u %u %u", &idx, &period, &duty) != 3) {
+        return -EINVAL;
+    }
+    if (idx >= nr_pins || duty > period || (period != 0 && period < LED_PWM_MIN_PERIOD_US)) {
+        return -EINVAL;
+    }
+    mutex_lock(&led_pwm_lock);
+    led_pwm_config(idx, period, duty);
+    mutex_unlock(&led_pwm_lock);
+    return 0;
+}
+
+// バンクのビットmaskのLEDのPWMを止める
+// set/clrのマスクで点灯/消灯を指定されたLEDはPWMをやめてその状態にする
+static void led_pwm_stop(u32 mask)
 {
-    char *msg;
-    printk("LED Write\n");
-    msg = kmalloc(2, GFP_KERNEL);
-    if (msg == NULL) {
+    unsigned int i;
+
+    mutex_lock(&led_pwm_lock);
+    for (i = 0; i < nr_pins; i++) {
+        if (mask & led_pwm_mask & BIT(i)) {
+            led_pwm_config(i, 0, 0);
+        }
+    }
+    mutex_unlock(&led_pwm_lock);
+}
+
+// 再生中の波形
+// ステップのset/clrはアップロード時にGPSET0/GPCLR0のビットに変換しておく
+struct led_wave {
+    u32 flags;
+    u32 count;
+    struct led_wave_step steps[];
+};
+
+// 波形の再生の統計
+// 更新するのは波形のタイマ関数だけなので、ロックを取らずに読み出す
+struct led_wave_stats {
+    u64 steps;          // 再生したステップ数
+    u64 loops;          // 先頭に戻った回数
+    u64 overruns;       // 前のステップが遅れて、次のステップの時刻をすでに過ぎていた回数
+    u64 late_max_ns;    // ステップの予定時刻からの遅れの最大値
+    u64 late_total_ns;  // ステップの予定時刻からの遅れの合計
+};
+
+static struct hrtimer led_wave_timer;
+static DEFINE_MUTEX(led_wave_lock);     // 波形の差し替えと停止を直列化する
+static struct led_wave *led_wave;       // NULLのときは再生していない
+static unsigned int led_wave_pos;       // 次に再生するステップ
+static struct led_wave_stats led_wave_stats;
+
+// 波形のタイマ関数
+// 予定時刻にステップを反映して、次のステップの予定時刻を前の予定時刻から計算する
+// そのため遅れがあっても次のステップ以降にずれが積み重ならない
+static enum hrtimer_restart led_wave_fn(struct hrtimer *timer)
+{
+    struct led_wave *w = led_wave;
+    struct led_wave_step *st = &w->steps[led_wave_pos];
+    ktime_t now = hrtimer_cb_get_time(timer);
+    u64 late = max_t(s64, ktime_to_ns(ktime_sub(now, hrtimer_get_expires(timer))), 0);
+
+    if (st->set != 0) {
+        led_reg_write(GPSET0, st->set);
+    }
+    if (st->clr != 0) {
+        led_reg_write(GPCLR0, st->clr);
+    }
+
+    WRITE_ONCE(led_wave_stats.steps, led_wave_stats.steps + 1);
+    WRITE_ONCE(led_wave_stats.late_total_ns, led_wave_stats.late_total_ns + late);
+    if (late > led_wave_stats.late_max_ns) {
+        WRITE_ONCE(led_wave_stats.late_max_ns, late);
+    }
+
+    if (++led_wave_pos == w->count) {
+        if (!(w->flags & LED_WAVE_LOOP)) {
+            return HRTIMER_NORESTART;
+        }
+        led_wave_pos = 0;
+        WRITE_ONCE(led_wave_stats.loops, led_wave_stats.loops + 1);
+    }
+    hrtimer_add_expires_ns(timer, (u64)w->steps[led_wave_pos].delay_us * NSEC_PER_USEC);
+    if (ktime_before(hrtimer_get_expires(timer), now)) {
+        WRITE_ONCE(led_wave_stats.overruns, led_wave_stats.overruns + 1);
+    }
+    return HRTIMER_RESTART;
+}
+
+// 再生中の波形を止めて解放する(led_wave_lockを取って呼ぶこと)
+static void led_wave_stop_locked(void)
+{
+    hrtimer_cancel(&led_wave_timer);
+    kvfree(led_wave);
+    led_wave = NULL;
+}
+
+// 再生中の波形を止める
+static void led_wave_stop(void)
+{
+    mutex_lock(&led_wave_lock);
+    led_wave_stop_locked();
+    mutex_unlock(&led_wave_lock);
+}
+
+// 1回のwriteで書き込まれた波形を検査して再生を始める
+static ssize_t led_wave_upload(const char __user *buf, size_t count)
+{
+    u32 all = nr_pins == 32 ? U32_MAX : BIT(nr_pins) - 1;
+    struct led_wave_header hdr;
+    struct led_wave_step *st;
+    struct led_wave *w;
+    u32 used = 0;
+    unsigned int i;
+
+    if (copy_from_user(&hdr, buf, sizeof(hdr))) {
+        return -EFAULT;
+    }
+    if (hdr.version != LED_WAVE_VERSION || hdr.flags & ~LED_WAVE_LOOP ||
+        hdr.count == 0 || hdr.count > LED_WAVE_MAX_STEPS ||
+        count != sizeof(hdr) + hdr.count * sizeof(*st)) {
+        return -EINVAL;
+    }
+
+    w = kvmalloc(struct_size(w, steps, hdr.count), GFP_KERNEL_ACCOUNT);
+    if (w == NULL) {
         return -ENOMEM;
     }
-    // echoされた文字を取得
-    if (copy_from_user(msg + *ppos, buf, count)) {
+    if (copy_from_user(w->steps, buf + sizeof(hdr), hdr.count * sizeof(*st))) {
+        kvfree(w);
         return -EFAULT;
     }
-    *ppos += count;
-    msg[*ppos] = '\0';
+    w->flags = hdr.flags;
+    w->count = hdr.count;
+    for (i = 0; i < w->count; i++) {
+        st = &w->steps[i];
+        if (st->delay_us < LED_WAVE_MIN_DELAY_US || (st->set | st->clr) & ~all || (st->set & st->clr)) {
+            kvfree(w);
+            return -EINVAL;
+        }
+        used |= st->set | st->clr;
+        st->set = led_bank_to_gpio(st->set);
+        st->clr = led_bank_to_gpio(st->clr);
+    }
 
-    request_mem_region(GPIO_BASE_ADDR, MEM_SIZE, DEV_NAME);
-    gpio = ioremap(GPIO_BASE_ADDR, MEM_SIZE);
+    // 波形で使うLEDのPWMは止める
+    led_pwm_stop(used);
 
-    if (sysfs_streq("1", msg)) {
-        printk("LED Turn on\n");
-        // LED点灯
-        gpio[GPSET0 / 4] = (1 << (LED_PIN % 32));
+    mutex_lock(&led_wave_lock);
+    led_wave_stop_locked();
+    led_wave = w;
+    led_wave_pos = 0;
+    hrtimer_start(&led_wave_timer, ns_to_ktime((u64)w->steps[0].delay_us * NSEC_PER_USEC), HRTIMER_MODE_REL_HARD);
+    mutex_unlock(&led_wave_lock);
+    return count;
+}
+
+// echoされた文字に従ってLEDを点灯/消灯する
+// "1"ならバンクのすべてを点灯し、"0"などそれ以外の1語ならすべてを消灯する
+// "<set> <clr>"のように2つのマスクを書くと、setのビットのLEDを点灯してclrのビットのLEDを消灯する
+// ビットiはpins[i]のLEDに対応し、バンク全体をGPSET0とGPCLR0への1回ずつの書き込みで更新する
+// "pwm <idx> <period_us> <duty_us>"と書くとidx番目のLEDをPWMで点滅させる
+// LED_WAVE_MAGICで始まるデータは波形として再生し、"wave stop"と書くと止める
+static ssize_t led_write_msg(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
+{
+    u32 all = nr_pins == 32 ? U32_MAX : BIT(nr_pins) - 1;
+    u32 set, clr, magic;
+    char msg[32];
+    char *p, *tok;
+    int ret;
+
+    // 波形データ
+    if (count >= sizeof(struct led_wave_header)) {
+        if (copy_from_user(&magic, buf, sizeof(magic))) {
+            return -EFAULT;
+        }
+        if (magic == LED_WAVE_MAGIC) {
+            return led_wave_upload(buf, count);
+        }
+    }
+
+    if (count >= sizeof(msg)) {
+        return -EINVAL;
+    }
+    // echoされた文字を取得
+    if (copy_from_user(msg, buf, count)) {
+        return -EFAULT;
+    }
+    msg[count] = '\0';
+
+    p = strim(msg);
+    tok = strsep(&p, " \t");
+    // pwmとwaveは引数がなければエラー(1語として扱ってバンクを消灯しない)
+    if (strcmp(tok, "pwm") == 0) {
+        if (p == NULL) {
+            return -EINVAL;
+        }
+        ret = led_pwm_parse(p);
+        return ret != 0 ? ret : count;
+    }
+    if (strcmp(tok, "wave") == 0) {
+        if (p == NULL || !sysfs_streq(p, "stop")) {
+            return -EINVAL;
+        }
+        led_wave_stop();
+        return count;
+    }
+    if (p == NULL) {    // 1語だけのとき
+        if (sysfs_streq("1", tok)) {
+            set = all;
+            clr = 0;
+        } else {
+            set = 0;
+            clr = all;
+        }
     } else {
-        printk("LED Turn off\n");
-        // LED消灯
-        gpio[GPCLR0 / 4] = (1 << (LED_PIN % 32));
-    }
- 
-    iounmap((void*)gpio);
-    release_mem_region(GPIO_BASE_ADDR, MEM_SIZE);
-    kfree(msg);
+        ret = kstrtou32(tok, 0, &set);
+        if (ret == 0) {
+            ret = kstrtou32(skip_spaces(p), 0, &clr);
+        }
+        if (ret != 0) {
+            return ret;
+        }
+        // バンクにないLEDや、点灯と消灯の両方が指定されたLEDがあるときはエラー
+        if ((set | clr) & ~all || (set & clr)) {
+            return -EINVAL;
+        }
+    }
+
+    // PWM中のLEDはPWMを止めてから指定された状態にする
+    if ((set | clr) & READ_ONCE(led_pwm_mask)) {
+        led_pwm_stop(set | clr);
+    }
+    set = led_bank_to_gpio(set);
+    clr = led_bank_to_gpio(clr);
+    trace_led_write(set, clr, count);
+    LED_DBG("set 0x%08x clear 0x%08x\n", set, clr);
+    // LED点灯
+    if (set != 0) {
+        led_reg_write(GPSET0, set);
+    }
+    // LED消灯
+    if (clr != 0) {
+        led_reg_write(GPCLR0, clr);
+    }
     return count;
 }
 
+// writeハンドラ
+static ssize_t led_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
+{
+    u64 start = ktime_get_ns();
+    ssize_t ret;
+
+    ret = led_write_msg(file, buf, count, ppos);
+    led_stat_op(LED_OP_WRITE, start, ret);
+    return ret;
+}
+
 // readハンドラ
 static ssize_t led_read(struct file *file, char __user *buf, size_t count, loff_t *ppos)
 {
-    printk("LED Read\n");
+    u64 start = ktime_get_ns();
+
+    trace_led_read(count, *ppos);
+    led_stat_op(LED_OP_READ, start, 0);
     return 0;
 }
 
@@ -95,23 +537,152 @@ static const struct file_operations led_fops = {
     .write   = led_write,
 };
 
+// debugfsのledディレクトリ
+static struct dentry *led_debugfs;
+
+// statsファイルのshow関数
+// 全CPU分を読み出したときに合計する
+static int led_stats_show(struct seq_file *m, void *v)
+{
+    return op_stats_show(m, &led_op_stats, led_op_names, LED_NR_OPS);
+}
+
+// statsファイルのwrite関数
+// "0"を書き込むと全CPUの統計を0に戻す(同時に行われている操作とは同期しない近似的なもの)
+static ssize_t led_stats_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
+{
+    return op_stats_write(buf, count, &led_op_stats, sizeof(struct op_stats));
+}
+
+static int led_stats_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, led_stats_show, NULL);
+}
+
+// debugfsのstatsファイルの操作構造体
+static const struct file_operations led_stats_fops = {
+    .owner   = THIS_MODULE,
+    .open    = led_stats_open,
+    .read    = seq_read,
+    .write   = led_stats_write,
+    .llseek  = seq_lseek,
+    .release = single_release,
+};
+
+// pwmファイルのshow関数
+// バンクのLEDごとに「番号 ピン 周期 デューティ」を1行ずつ出力する(マイクロ秒)
+static ssize_t led_show_pwm(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    ssize_t len = 0;
+    unsigned int i;
+
+    mutex_lock(&led_pwm_lock);
+    for (i = 0; i < nr_pins; i++) {
+        len += sysfs_emit_at(buf, len, "%u %u %u %u\n", i, pins[i], led_pwm[i].period_us, led_pwm[i].duty_us);
+    }
+    mutex_unlock(&led_pwm_lock);
+    return len;
+}
+
+// pwmファイルのstore関数
+// "<idx> <period_us> <duty_us>"を書き込むとidx番目のLEDのPWMを設定する
+static ssize_t led_store_pwm(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+    int ret;
+
+    ret = led_pwm_parse(buf);
+    return ret != 0 ? ret : count;
+}
+
+static DEVICE_ATTR(pwm, 0644, led_show_pwm, led_store_pwm);
+
+// デバイス属性構造体配列
+static struct attribute *led_attrs[] = {
+    &dev_attr_pwm.attr,
+    NULL,
+};
+ATTRIBUTE_GROUPS(led);
+
+// wave_statsファイルのshow関数
+static int led_wave_stats_show(struct seq_file *m, void *v)
+{
+    u64 steps = READ_ONCE(led_wave_stats.steps);
+
+    seq_printf(m, "playing %d\n", hrtimer_active(&led_wave_timer));
+    seq_printf(m, "steps %llu\n", steps);
+    seq_printf(m, "loops %llu\n", READ_ONCE(led_wave_stats.loops));
+    seq_printf(m, "overruns %llu\n", READ_ONCE(led_wave_stats.overruns));
+    seq_printf(m, "late_max_ns %llu\n", READ_ONCE(led_wave_stats.late_max_ns));
+    seq_printf(m, "late_avg_ns %llu\n", steps ? div64_u64(READ_ONCE(led_wave_stats.late_total_ns), steps) : 0);
+    return 0;
+}
+
+// wave_statsファイルのwrite関数
+// "0"を書き込むと統計を0に戻す
+static ssize_t led_wave_stats_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
+{
+    unsigned int val;
+    int ret;
+
+    ret = kstrtouint_from_user(buf, count, 0, &val);
+    if (ret != 0) {
+        return ret;
+    }
+    if (val != 0) {
+        return -EINVAL;
+    }
+    // 再生中はタイマ関数と同時に書き換えることがあるが、統計がずれるだけなので止めない
+    WRITE_ONCE(led_wave_stats.steps, 0);
+    WRITE_ONCE(led_wave_stats.loops, 0);
+    WRITE_ONCE(led_wave_stats.overruns, 0);
+    WRITE_ONCE(led_wave_stats.late_max_ns, 0);
+    WRITE_ONCE(led_wave_stats.late_total_ns, 0);
+    return count;
+}
+
+static int led_wave_stats_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, led_wave_stats_show, NULL);
+}
+
+// debugfsのwave_statsファイルの操作構造体
+static const struct file_operations led_wave_stats_fops = {
+    .owner   = THIS_MODULE,
+    .open    = led_wave_stats_open,
+    .read    = seq_read,
+    .write   = led_wave_stats_write,
+    .llseek  = seq_lseek,
+    .release = single_release,
+};
+
 // class構造体
 static struct class led_class = {
-    .owner  = THIS_MODULE,
-    .name   = DEV_NAME,
+    .owner      = THIS_MODULE,
+    .name       = DEV_NAME,
+    .dev_groups = led_groups,
 };
 
 // probe関数
 static int led_probe(struct platform_device *pdev)
 {
     struct device *dev;
+    unsigned int i;
     printk("LED Probe\n");
 
-    request_mem_region(GPIO_BASE_ADDR, MEM_SIZE, DEV_NAME);
-    gpio = ioremap(GPIO_BASE_ADDR, MEM_SIZE);
-    // GPIO18を出力に設定
-    gpio[GPFSEL1 / 4] &= ~(0x7 << ((LED_PIN % 10) * 3));
-    gpio[GPFSEL1 / 4] |= (0x1 << ((LED_PIN % 10) * 3));
+    // GPIOレジスタをデバイスが削除されるまでマップしておく
+    // レジスタの範囲はpinctrl-bcm2835が確保しているので、request_mem_regionはせずにマップだけする
+    // ioremapの解除はデバイスの削除時に自動で行われる
+    if (!sim) {
+        gpio = devm_ioremap(&pdev->dev, GPIO_BASE_ADDR, MEM_SIZE);
+        if (gpio == NULL) {
+            dev_err(&pdev->dev, "failed to map GPIO registers.\n");
+            return -ENOMEM;
+        }
+    }
+    // バンクのピンを出力に設定
+    for (i = 0; i < nr_pins; i++) {
+        led_reg_write(gpio_fsel_reg(pins[i]), gpio_fsel_val(led_reg_read(gpio_fsel_reg(pins[i])), pins[i], GPIO_FSEL_OUTPUT));
+    }
 
     // デバイスファイルを作成する
     dev = device_create(&led_class, NULL, MKDEV(LED_MAJOR_NUM, 0), NULL, DEV_NAME);
@@ -119,8 +690,6 @@ static int led_probe(struct platform_device *pdev)
         dev_err(&pdev->dev, "failed to create device.\n");
         return PTR_ERR(dev);
     }
-    iounmap((void*)gpio);
-    release_mem_region(GPIO_BASE_ADDR, MEM_SIZE);
     return 0;
 }
 
@@ -131,12 +700,11 @@ static int led_remove(struct platform_device *pdev)
     // デバイスファイルを削除する
     device_destroy(&led_class, MKDEV(LED_MAJOR_NUM, 0));
 
-    request_mem_region(GPIO_BASE_ADDR, MEM_SIZE, DEV_NAME);
-    gpio = ioremap(GPIO_BASE_ADDR, MEM_SIZE);
-    // Turn off the LED
-    gpio[GPCLR0 / 4] = (1 << (LED_PIN % 32));
-    iounmap((void*)gpio);
-    release_mem_region(GPIO_BASE_ADDR, MEM_SIZE);
+    // 波形とPWMを止めてから
+    led_wave_stop();
+    led_pwm_stop(U32_MAX);
+    // Turn off the LEDs
+    led_reg_write(GPCLR0, led_bank_to_gpio(U32_MAX));
 
     return 0;
 }
@@ -157,9 +725,29 @@ static struct platform_device *pdev;
 // 初期化関数
 static int __init led_init(void)
 {
+    unsigned int i;
+    u32 mask = 0;
     int ret = 0;
     printk("LED Init\n");
 
+    // バンクのピンはGPSET0/GPCLR0で扱える0〜31で、重複していないこと
+    for (i = 0; i < nr_pins; i++) {
+        if (pins[i] >= 32 || (mask & gpio_pin_bit(pins[i]))) {
+            printk("LED Init: invalid pin %u\n", pins[i]);
+            return -EINVAL;
+        }
+        mask |= gpio_pin_bit(pins[i]);
+        hrtimer_init(&led_pwm[i].timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_HARD);
+        led_pwm[i].timer.function = led_pwm_fn;
+    }
+    hrtimer_init(&led_wave_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_HARD);
+    led_wave_timer.function = led_wave_fn;
+
+    // probeより前に疑似レジスタに切り替えておく
+    if (sim) {
+        static_branch_enable(&led_sim_key);
+    }
+
     // クラスの登録
     ret = class_register(&led_class);
     if (ret != 0) {
@@ -181,19 +769,31 @@ static int __init led_init(void)
     if (ret != 0) {
         printk("LED Init: register_chrdev is err %d\n", ret);
         platform_driver_unregister(&led_driver);
+        class_unregister(&led_class);
         return ret;
     }
     printk("LED Init: register_chrdev OK\n");
 
     // プラットフォームバスにデバイスを登録
     pdev = platform_device_register_simple(DEV_NAME, -1, NULL, 0);
-    if (!pdev) {
-        printk("SKLE Init: platform_device_register_simple is err %d\n", ret);
-        unregister_chrdev(LED_MAJOR_NUM, "led");
-        return -1;
+    if (IS_ERR(pdev)) {
+        ret = PTR_ERR(pdev);
+        printk("LED Init: platform_device_register_simple is err %d\n", ret);
+        unregister_chrdev(LED_MAJOR_NUM, DEV_NAME);
+        platform_driver_unregister(&led_driver);
+        class_unregister(&led_class);
+        return ret;
     }
     printk("LED Init: platform_device_register_simple is OK\n");
 
+    // debugfsに統計のファイルを作る
+    led_debugfs = debugfs_create_dir(DEV_NAME, NULL);
+    debugfs_create_file("stats", 0600, led_debugfs, NULL, &led_stats_fops);
+    debugfs_create_file("wave_stats", 0600, led_debugfs, NULL, &led_wave_stats_fops);
+    if (sim) {  // 疑似レジスタのGPLEV0でLEDの状態を確認できる
+        debugfs_create_atomic_t("sim_gplev0", 0444, led_debugfs, &led_sim_regs[GPLEV0 / 4]);
+    }
+
     return ret;
 }
 
@@ -201,6 +801,7 @@ static int __init led_init(void)
 static void __exit led_exit(void)
 {
     printk("LED Exit\n");
+    debugfs_remove(led_debugfs);    // debugfsのディレクトリを削除
     platform_device_unregister(pdev);   // プラットフォームバスからデバイスの登録を解除
     unregister_chrdev(LED_MAJOR_NUM, DEV_NAME);  // キャラクタ登録を解除
     platform_driver_unregister(&led_driver);   // プラットフォームバスからドライバの登録を解除
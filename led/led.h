@@ -0,0 +1,33 @@
+#ifndef _LED_H
+#define _LED_H
+
+#include <linux/types.h>
+
+// /dev/ledに1回のwriteで書き込む波形データの形式
+// 先頭にこのヘッダを置き、続けてcount個のstruct led_wave_stepを並べる
+// 書き込むとすぐに先頭のステップから再生を始める("wave stop"を書き込むと止まる)
+#define LED_WAVE_MAGIC      0x5641574c  // "LWAV"
+#define LED_WAVE_VERSION    1
+
+#define LED_WAVE_LOOP       0x1         // 最後のステップの次は先頭に戻る
+
+#define LED_WAVE_MAX_STEPS  65536
+#define LED_WAVE_MIN_DELAY_US 10
+
+struct led_wave_header {
+    __u32 magic;        // LED_WAVE_MAGIC
+    __u32 version;      // LED_WAVE_VERSION
+    __u32 flags;        // LED_WAVE_*
+    __u32 count;        // ステップ数(1〜LED_WAVE_MAX_STEPS)
+};
+
+// 波形の1ステップ
+// 前のステップ(先頭のステップは再生開始)からdelay_usだけ待ってからsetのLEDを点灯し、clrのLEDを消灯する
+// ビットiはpinsモジュールパラメータのi番目のLEDに対応する
+struct led_wave_step {
+    __u32 delay_us;     // LED_WAVE_MIN_DELAY_US以上
+    __u32 set;
+    __u32 clr;
+};
+
+#endif
@@ -0,0 +1,70 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM led
+
+#if !defined(_LED_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _LED_TRACE_H
+
+#include <linux/tracepoint.h>
+
+// open/release
+DECLARE_EVENT_CLASS(led_file,
+    TP_PROTO(unsigned int minor),
+    TP_ARGS(minor),
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+    ),
+    TP_fast_assign(
+        __entry->minor = minor;
+    ),
+    TP_printk("minor=%u", __entry->minor)
+);
+
+DEFINE_EVENT(led_file, led_open,
+    TP_PROTO(unsigned int minor),
+    TP_ARGS(minor)
+);
+
+DEFINE_EVENT(led_file, led_release,
+    TP_PROTO(unsigned int minor),
+    TP_ARGS(minor)
+);
+
+// write: 書き込まれたバイト数と、GPSET0/GPCLR0に書き込んだビット
+TRACE_EVENT(led_write,
+    TP_PROTO(u32 set, u32 clr, size_t count),
+    TP_ARGS(set, clr, count),
+    TP_STRUCT__entry(
+        __field(u32, set)
+        __field(u32, clr)
+        __field(size_t, count)
+    ),
+    TP_fast_assign(
+        __entry->set = set;
+        __entry->clr = clr;
+        __entry->count = count;
+    ),
+    TP_printk("set=0x%08x clr=0x%08x count=%zu", __entry->set, __entry->clr, __entry->count)
+);
+
+// read
+TRACE_EVENT(led_read,
+    TP_PROTO(size_t count, loff_t pos),
+    TP_ARGS(count, pos),
+    TP_STRUCT__entry(
+        __field(size_t, count)
+        __field(loff_t, pos)
+    ),
+    TP_fast_assign(
+        __entry->count = count;
+        __entry->pos = pos;
+    ),
+    TP_printk("count=%zu pos=%lld", __entry->count, __entry->pos)
+);
+
+#endif
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE led_trace
+#include <trace/define_trace.h>
@@ -2,34 +2,37 @@
 #include <linux/fs.h>
 #include <linux/platform_device.h>
 
+#define CREATE_TRACE_POINTS
+#include "skel_trace.h"
+
 #define DEV_NAME "skel"
 #define SKEL_MAJOR_NUM 60
 
 // openハンドラ
 static int skel_open(struct inode *inode, struct file *file)
 {
-    printk("SKEL Open\n");
+    trace_skel_open(iminor(inode));
     return 0;
 }
 
 // releaseハンドラ
 static int skel_release(struct inode *inode, struct file *file)
 {
-    printk("SKEL Release\n");
+    trace_skel_release(iminor(inode));
     return 0;
 }
 
 // writeハンドラ
 static ssize_t skel_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
 {
-    printk("SKEL Write\n");
+    trace_skel_write(count, *ppos);
     return count;
 }
 
 // readハンドラ
 static ssize_t skel_read(struct file *file, char __user *buf, size_t count, loff_t *ppos)
 {
-    printk("SKEL Read\n");
+    trace_skel_read(count, *ppos);
     return 0;
 }
 
@@ -0,0 +1,63 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM skel
+
+#if !defined(_SKEL_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _SKEL_TRACE_H
+
+#include <linux/tracepoint.h>
+
+// open/release
+DECLARE_EVENT_CLASS(skel_file,
+    TP_PROTO(unsigned int minor),
+    TP_ARGS(minor),
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+    ),
+    TP_fast_assign(
+        __entry->minor = minor;
+    ),
+    TP_printk("minor=%u", __entry->minor)
+);
+
+DEFINE_EVENT(skel_file, skel_open,
+    TP_PROTO(unsigned int minor),
+    TP_ARGS(minor)
+);
+
+DEFINE_EVENT(skel_file, skel_release,
+    TP_PROTO(unsigned int minor),
+    TP_ARGS(minor)
+);
+
+// read/write: 要求されたバイト数とファイル位置
+DECLARE_EVENT_CLASS(skel_rw,
+    TP_PROTO(size_t count, loff_t pos),
+    TP_ARGS(count, pos),
+    TP_STRUCT__entry(
+        __field(size_t, count)
+        __field(loff_t, pos)
+    ),
+    TP_fast_assign(
+        __entry->count = count;
+        __entry->pos = pos;
+    ),
+    TP_printk("count=%zu pos=%lld", __entry->count, __entry->pos)
+);
+
+DEFINE_EVENT(skel_rw, skel_read,
+    TP_PROTO(size_t count, loff_t pos),
+    TP_ARGS(count, pos)
+);
+
+DEFINE_EVENT(skel_rw, skel_write,
+    TP_PROTO(size_t count, loff_t pos),
+    TP_ARGS(count, pos)
+);
+
+#endif
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE skel_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,107 @@
+#ifndef _STACK_H
+#define _STACK_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+// ストリームモード(/dev/stack_stream)で1メッセージごとに付けるヘッダ
+// read/writeのデータは「ヘッダ + lenバイトのメッセージ」の繰り返しになる
+struct stack_frame {
+    __u32 len;          // 続くメッセージのバイト数
+    __u32 prio;         // 優先度(prioのインスタンスだけ使う。大きいほど先にpopされる)
+};
+
+// ioctlで1メッセージ分のユーザバッファを表す
+struct stack_iov {
+    __u64 buf;          // ユーザバッファのアドレス
+    __u32 len;          // push: メッセージ長 / pop, peek: バッファサイズ(実際のメッセージ長が返る)
+    __u32 prio;         // push: 優先度 / pop, peek: メッセージの優先度が返る
+};
+
+// STACK_IOC_PUSH / STACK_IOC_POP / STACK_IOC_PEEKの引数
+struct stack_batch {
+    __u64 iov;          // struct stack_iovの配列のアドレス
+    __u32 count;        // 配列の要素数
+    __u32 done;         // 処理できたメッセージ数(カーネルが書き込む)
+};
+
+// STACK_IOC_DEPTHの結果
+struct stack_depth {
+    __u32 depth;        // 積まれているメッセージ数
+    __u32 top_len;      // 次にpopされるメッセージのバイト数(空なら0)
+};
+
+// mmapで共有するリングバッファの先頭に置かれるヘッダ
+// ring_slotsモジュールパラメータを指定したときだけmmapできる
+// スロットiは先頭からslot_offset + (i & (slots - 1)) * slot_sizeの位置にある
+struct stack_ring {
+    __u32 slots;        // スロット数(2のべき乗)
+    __u32 slot_size;    // 1スロットのバイト数(struct stack_ring_slot込み)
+    __u32 slot_offset;  // 先頭からスロット配列までのオフセット
+    __u32 waiters;      // STACK_IOC_RING_WAITで寝ているスレッド数
+    __u32 head __attribute__((aligned(64)));   // 次にpopする位置
+    __u32 tail __attribute__((aligned(64)));   // 次にpushする位置
+};
+
+#define STACK_RING_SLOT_OFFSET 256
+
+// リングの1スロット
+// push: tailの位置のseqがtailと等しければtailをCASで進めて書き込み、seqをtail + 1にする
+// pop:  headの位置のseqがhead + 1なら headをCASで進めて読み出し、seqをhead + slotsにする
+// push/popの後はメモリバリアを入れてからwaitersを確認し、0でなければSTACK_IOC_RING_WAKEを呼ぶ
+// seqを壊すとカーネル側のpush/popは確保を諦めて-EAGAINで失敗する
+struct stack_ring_slot {
+    __u32 seq;
+    __u32 len;
+    char data[];
+};
+
+#define STACK_RING_WAIT_READ  1     // リングが空でなくなるまで待つ
+#define STACK_RING_WAIT_WRITE 2     // リングに空きができるまで待つ
+
+// debugfsのstack/stackN/snapshotファイルの形式
+// 先頭にこのヘッダを置き、続けてcount個の「struct stack_frame + lenバイトのメッセージ」を
+// pushされた順に並べる。読み込むと書き出し、書き込むと同じ順番でpushし直す
+#define STACK_SNAPSHOT_MAGIC   0x534b5453  // "STKS"
+#define STACK_SNAPSHOT_VERSION 1
+
+struct stack_snapshot_header {
+    __u32 magic;        // STACK_SNAPSHOT_MAGIC
+    __u32 version;      // STACK_SNAPSHOT_VERSION
+    __u64 count;        // メッセージ数(書き込むときは参考値)
+};
+
+// io_uringのIORING_OP_URING_CMDで使うコマンド(sqe->cmd_op)
+// /dev/stackN_streamに対して発行する。cqe->resには処理したバイト数やメッセージ数が返る
+#define STACK_URING_PUSH        1   // メッセージを1つpush
+#define STACK_URING_POP         2   // メッセージを1つpop(空のときはpushされるまで完了しない)
+#define STACK_URING_PUSH_BATCH  3   // struct stack_iovの配列をまとめてpush
+#define STACK_URING_POP_BATCH   4   // struct stack_iovの配列にまとめてpop
+
+// uring_cmdの引数(sqe->cmdに置く)
+struct stack_uring_cmd {
+    __u64 buf;          // PUSH/POP: バッファのアドレス / *_BATCH: struct stack_iovの配列のアドレス
+    __u32 len;          // PUSH: メッセージ長 / POP: バッファサイズ / *_BATCH: 配列の要素数
+    __u32 prio;         // PUSH: 優先度
+};
+
+// pushのBPFフック(stack_bpf_push_hookにアタッチするfmod_retプログラム)が返す判定
+// 下位8ビットが判定、上位ビットが判定の引数
+#define STACK_BPF_PASS      0   // そのまま積む
+#define STACK_BPF_DROP      1   // 捨てる(pushは成功扱い)
+#define STACK_BPF_TAG       2   // 優先度を引数の値にして積む
+#define STACK_BPF_REDIRECT  3   // 引数の番号のインスタンスに積む
+#define STACK_BPF_VERDICT_MASK  0xff
+#define STACK_BPF_ARG_SHIFT     8
+#define STACK_BPF_VERDICT(v, arg)   (((arg) << STACK_BPF_ARG_SHIFT) | (v))
+
+#define STACK_IOC_MAGIC 's'
+#define STACK_IOC_PUSH  _IOWR(STACK_IOC_MAGIC, 1, struct stack_batch)  // まとめてpush
+#define STACK_IOC_POP   _IOWR(STACK_IOC_MAGIC, 2, struct stack_batch)  // まとめてpop
+#define STACK_IOC_PEEK  _IOWR(STACK_IOC_MAGIC, 3, struct stack_batch)  // 取り出さずに参照
+#define STACK_IOC_DEPTH _IOR(STACK_IOC_MAGIC, 4, struct stack_depth)   // メッセージ数の取得
+#define STACK_IOC_RING_WAIT _IO(STACK_IOC_MAGIC, 5)    // リングの状態変化を待つ(引数はSTACK_RING_WAIT_*)
+#define STACK_IOC_RING_WAKE _IO(STACK_IOC_MAGIC, 6)    // リングを待っているスレッドを起こす
+#define STACK_IOC_SET_PRIO  _IO(STACK_IOC_MAGIC, 7)    // 書き込み中のメッセージの優先度を設定(引数は優先度)
+
+#endif
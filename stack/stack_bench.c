@@ -0,0 +1,445 @@
+// /dev/stackの負荷生成とベンチマークを行うユーザ空間のツール
+// プロデューサとコンシューマのスレッドを指定した数だけ動かし、
+// スループットとpush/pop 1回あたりのレイテンシ(p50/p99/p999)をJSONで出力する
+//
+// 使い方: ./stack_bench [-d /dev/stack0] [-m msg|stream|batch] [-p producers] [-c consumers]
+//                       [-s size] [-n messages] [-b batch]
+//   msg:    1メッセージごとにopen/write/closeとopen/read/closeを行う(通常モード)
+//   stream: /dev/stackN_streamにフレームをwrite/readする(1回でbメッセージまで)
+//   batch:  /dev/stackN_streamにSTACK_IOC_PUSH/STACK_IOC_POPを発行する(1回でbメッセージまで)
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+
+#include "stack.h"
+
+enum bench_mode {
+    MODE_MSG,
+    MODE_STREAM,
+    MODE_BATCH,
+};
+
+static const char * const mode_names[] = {
+    [MODE_MSG] = "msg",
+    [MODE_STREAM] = "stream",
+    [MODE_BATCH] = "batch",
+};
+
+// コマンドライン引数
+static const char *dev = "/dev/stack0";
+static char stream_dev[256];
+static enum bench_mode mode = MODE_MSG;
+static unsigned int producers = 1;
+static unsigned int consumers = 1;
+static unsigned int msg_size = 16;      // モジュールのmax_msg_size以下にする
+static unsigned long messages = 100000; // プロデューサ1つあたりのメッセージ数
+static unsigned int batch = 1;
+
+// まだコンシューマが受け持っていないメッセージ数
+// コンシューマは取り出す前にここから自分の分を確保するので、待ったまま終わらないことはない
+static unsigned long unclaimed;
+static pthread_mutex_t claim_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// 1回の操作のレイテンシ(ナノ秒)を記録する可変長配列
+struct samples {
+    uint64_t *v;
+    size_t n;
+    size_t cap;
+};
+
+// スレッドごとの状態
+struct worker {
+    pthread_t thread;
+    unsigned int id;
+    unsigned long msgs;     // push/popしたメッセージ数
+    struct samples lat;
+    int err;                // 失敗したときのerrno
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void samples_add(struct samples *s, uint64_t ns)
+{
+    if (s->n == s->cap) {
+        s->cap = s->cap ? s->cap * 2 : 4096;
+        s->v = realloc(s->v, s->cap * sizeof(*s->v));
+        if (s->v == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    s->v[s->n++] = ns;
+}
+
+// 残っているメッセージからmax個までを自分の分として確保する
+static unsigned long claim(unsigned long max)
+{
+    unsigned long n;
+
+    pthread_mutex_lock(&claim_lock);
+    n = unclaimed < max ? unclaimed : max;
+    unclaimed -= n;
+    pthread_mutex_unlock(&claim_lock);
+    return n;
+}
+
+// 通常モードで1メッセージをpushする
+static int push_msg(const char *buf)
+{
+    int fd, ret = 1;
+
+    fd = open(dev, O_WRONLY);
+    if (fd < 0) {
+        return -errno;
+    }
+    if (write(fd, buf, msg_size) != (ssize_t)msg_size) {
+        ret = -errno;
+    }
+    // closeしたときにpushされる
+    if (close(fd) != 0 && ret > 0) {
+        ret = -errno;
+    }
+    return ret;
+}
+
+// 通常モードで1メッセージをpopする
+static int pop_msg(char *buf)
+{
+    int fd, ret = 1;
+
+    // openしたときにpopされる
+    fd = open(dev, O_RDONLY);
+    if (fd < 0) {
+        return -errno;
+    }
+    if (read(fd, buf, msg_size) < 0) {
+        ret = -errno;
+    }
+    close(fd);
+    return ret;
+}
+
+// ストリームモードでn個のフレームをまとめてwriteする
+static int push_stream(int fd, char *buf, unsigned int n)
+{
+    size_t len = n * (sizeof(struct stack_frame) + msg_size);
+
+    if (write(fd, buf, len) != (ssize_t)len) {
+        return -errno;
+    }
+    return n;
+}
+
+// ストリームモードで最大n個のフレームをreadして取り出せた数を返す
+// すべてのメッセージが同じサイズなので、フレームが途中で分かれることはない
+static int pop_stream(int fd, char *buf, unsigned int n)
+{
+    size_t frame = sizeof(struct stack_frame) + msg_size;
+    ssize_t len;
+
+    len = read(fd, buf, n * frame);
+    if (len < 0) {
+        return -errno;
+    }
+    return len / frame;
+}
+
+// STACK_IOC_PUSH/STACK_IOC_POPでn個をまとめて処理して処理できた数を返す
+static int batch_ioctl(int fd, unsigned long cmd, struct stack_iov *iov, unsigned int n)
+{
+    struct stack_batch b = {
+        .iov = (uintptr_t)iov,
+        .count = n,
+    };
+    unsigned int i;
+
+    for (i = 0; i < n; i++) {
+        iov[i].len = msg_size;
+    }
+    if (ioctl(fd, cmd, &b) != 0) {
+        return -errno;
+    }
+    return b.done;
+}
+
+// メッセージ用のバッファを用意する
+// streamはフレームヘッダ込み、batchはstruct stack_iovの配列も作る
+static char *alloc_buf(struct stack_iov **iov)
+{
+    size_t frame = sizeof(struct stack_frame) + msg_size;
+    struct stack_frame *hdr;
+    unsigned int i;
+    char *buf;
+
+    buf = calloc(batch, frame);
+    *iov = calloc(batch, sizeof(**iov));
+    if (buf == NULL || *iov == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    for (i = 0; i < batch; i++) {
+        hdr = (struct stack_frame *)(buf + i * frame);
+        hdr->len = msg_size;
+        memset(hdr + 1, 'a' + i % 26, msg_size);
+        (*iov)[i].buf = (uintptr_t)(buf + i * frame + sizeof(*hdr));
+    }
+    return buf;
+}
+
+static int open_stream(void)
+{
+    return open(stream_dev, O_RDWR);
+}
+
+// プロデューサスレッド
+static void *producer(void *arg)
+{
+    struct worker *w = arg;
+    struct stack_iov *iov;
+    char *buf = alloc_buf(&iov);
+    unsigned long left = messages;
+    uint64_t start;
+    unsigned int n;
+    int fd = -1, ret = 0;
+
+    if (mode != MODE_MSG && (fd = open_stream()) < 0) {
+        w->err = errno;
+        goto out;
+    }
+    while (left > 0) {
+        n = left < batch ? left : batch;
+        start = now_ns();
+        switch (mode) {
+        case MODE_MSG:
+            ret = push_msg((char *)(uintptr_t)iov[0].buf);
+            break;
+        case MODE_STREAM:
+            ret = push_stream(fd, buf, n);
+            break;
+        case MODE_BATCH:
+            ret = batch_ioctl(fd, STACK_IOC_PUSH, iov, n);
+            break;
+        }
+        if (ret < 0) {
+            w->err = -ret;
+            break;
+        }
+        samples_add(&w->lat, now_ns() - start);
+        w->msgs += ret;
+        left -= ret;
+    }
+out:
+    if (fd >= 0) {
+        close(fd);
+    }
+    free(iov);
+    free(buf);
+    return NULL;
+}
+
+// コンシューマスレッド
+static void *consumer(void *arg)
+{
+    struct worker *w = arg;
+    struct stack_iov *iov;
+    char *buf = alloc_buf(&iov);
+    unsigned long mine = 0;
+    uint64_t start;
+    unsigned int n;
+    int fd = -1, ret = 0;
+
+    if (mode != MODE_MSG && (fd = open_stream()) < 0) {
+        w->err = errno;
+        goto out;
+    }
+    for (;;) {
+        // 確保した分を取り出し終えたら次の分を確保する
+        if (mine == 0) {
+            mine = claim(batch);
+            if (mine == 0) {
+                break;
+            }
+        }
+        n = mine;
+        start = now_ns();
+        switch (mode) {
+        case MODE_MSG:
+            ret = pop_msg(buf);
+            break;
+        case MODE_STREAM:
+            ret = pop_stream(fd, buf, n);
+            break;
+        case MODE_BATCH:
+            ret = batch_ioctl(fd, STACK_IOC_POP, iov, n);
+            break;
+        }
+        if (ret < 0) {
+            w->err = -ret;
+            break;
+        }
+        samples_add(&w->lat, now_ns() - start);
+        w->msgs += ret;
+        mine -= ret;
+    }
+out:
+    if (fd >= 0) {
+        close(fd);
+    }
+    free(iov);
+    free(buf);
+    return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+// 全スレッドのレイテンシをまとめてパーセンタイルをJSONで出力する
+static void print_latency(const char *name, struct worker *w, unsigned int nr)
+{
+    struct samples all = { 0 };
+    unsigned int i;
+    size_t j;
+
+    for (i = 0; i < nr; i++) {
+        for (j = 0; j < w[i].lat.n; j++) {
+            samples_add(&all, w[i].lat.v[j]);
+        }
+    }
+    qsort(all.v, all.n, sizeof(*all.v), cmp_u64);
+#define PCT(p) (all.n ? all.v[(size_t)((all.n - 1) * (p))] : 0)
+    printf("\"%s\":{\"ops\":%zu,\"p50_ns\":%lu,\"p99_ns\":%lu,\"p999_ns\":%lu,\"max_ns\":%lu}",
+           name, all.n, (unsigned long)PCT(0.5), (unsigned long)PCT(0.99), (unsigned long)PCT(0.999),
+           (unsigned long)PCT(1.0));
+#undef PCT
+    free(all.v);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-d dev] [-m msg|stream|batch] [-p producers] [-c consumers]"
+            " [-s size] [-n messages] [-b batch]\n", prog);
+    exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+    struct worker *prod, *cons;
+    uint64_t start, elapsed;
+    unsigned long total = 0;
+    unsigned int i;
+    int opt, err = 0;
+
+    while ((opt = getopt(argc, argv, "d:m:p:c:s:n:b:h")) != -1) {
+        switch (opt) {
+        case 'd':
+            dev = optarg;
+            break;
+        case 'm':
+            for (i = 0; i < sizeof(mode_names) / sizeof(mode_names[0]); i++) {
+                if (strcmp(optarg, mode_names[i]) == 0) {
+                    break;
+                }
+            }
+            if (i == sizeof(mode_names) / sizeof(mode_names[0])) {
+                usage(argv[0]);
+            }
+            mode = i;
+            break;
+        case 'p':
+            producers = strtoul(optarg, NULL, 0);
+            break;
+        case 'c':
+            consumers = strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            msg_size = strtoul(optarg, NULL, 0);
+            break;
+        case 'n':
+            messages = strtoul(optarg, NULL, 0);
+            break;
+        case 'b':
+            batch = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (producers == 0 || consumers == 0 || msg_size == 0 || batch == 0) {
+        usage(argv[0]);
+    }
+    if (mode == MODE_MSG) {
+        batch = 1;  // 通常モードは1回に1メッセージ
+    }
+    snprintf(stream_dev, sizeof(stream_dev), "%s_stream", dev);
+    unclaimed = producers * messages;
+
+    prod = calloc(producers, sizeof(*prod));
+    cons = calloc(consumers, sizeof(*cons));
+    if (prod == NULL || cons == NULL) {
+        perror("calloc");
+        return 1;
+    }
+
+    start = now_ns();
+    for (i = 0; i < consumers; i++) {
+        cons[i].id = i;
+        pthread_create(&cons[i].thread, NULL, consumer, &cons[i]);
+    }
+    for (i = 0; i < producers; i++) {
+        prod[i].id = i;
+        pthread_create(&prod[i].thread, NULL, producer, &prod[i]);
+    }
+    for (i = 0; i < producers; i++) {
+        pthread_join(prod[i].thread, NULL);
+        if (prod[i].err != 0) {
+            fprintf(stderr, "producer %u: %s\n", i, strerror(prod[i].err));
+            err = 1;
+        }
+    }
+    // プロデューサが失敗したときは残りが積まれないので、コンシューマには最後まで待たせない
+    if (err) {
+        for (i = 0; i < consumers; i++) {
+            pthread_cancel(cons[i].thread);
+        }
+    }
+    for (i = 0; i < consumers; i++) {
+        pthread_join(cons[i].thread, NULL);
+        if (cons[i].err != 0) {
+            fprintf(stderr, "consumer %u: %s\n", i, strerror(cons[i].err));
+            err = 1;
+        }
+        total += cons[i].msgs;
+    }
+    elapsed = now_ns() - start;
+
+    printf("{\"mode\":\"%s\",\"device\":\"%s\",\"producers\":%u,\"consumers\":%u,"
+           "\"size\":%u,\"batch\":%u,\"messages\":%lu,\"elapsed_ns\":%lu,"
+           "\"msgs_per_sec\":%.0f,\"bytes_per_sec\":%.0f,",
+           mode_names[mode], dev, producers, consumers, msg_size, batch, total,
+           (unsigned long)elapsed, total * 1e9 / elapsed, total * msg_size * 1e9 / elapsed);
+    print_latency("push", prod, producers);
+    printf(",");
+    print_latency("pop", cons, consumers);
+    printf("}\n");
+
+    return err;
+}
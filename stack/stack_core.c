@@ -0,0 +1,162 @@
+#include <linux/kernel.h>
+
+#include "stack_core.h"
+
+// aがbより先にpopされるか
+bool stack_msg_before(const struct stack_msg *a, const struct stack_msg *b)
+{
+    return a->prio != b->prio ? a->prio > b->prio : a->seq < b->seq;
+}
+
+// 以下のヒープ操作はsize個の要素が入った配列heapだけを扱う
+
+// ヒープにメッセージを追加する(heapにはsize + 1個分の領域があること)
+void stack_heap_push(struct stack_msg **heap, unsigned int size, struct stack_msg *msg)
+{
+    unsigned int i = size, parent;
+
+    while (i > 0) {
+        parent = (i - 1) / 2;
+        if (!stack_msg_before(msg, heap[parent])) {
+            break;
+        }
+        heap[i] = heap[parent];
+        i = parent;
+    }
+    heap[i] = msg;
+}
+
+// ヒープの先頭のメッセージを取り除く
+void stack_heap_pop(struct stack_msg **heap, unsigned int size)
+{
+    unsigned int n = size - 1;     // 取り除いた後の要素数
+    struct stack_msg *last = heap[n];
+    unsigned int i = 0, child;
+
+    while ((child = 2 * i + 1) < n) {
+        if (child + 1 < n && stack_msg_before(heap[child + 1], heap[child])) {
+            child++;
+        }
+        if (!stack_msg_before(heap[child], last)) {
+            break;
+        }
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = last;
+}
+
+// ヒープの中でpopされる順に先頭からmax個までのメッセージをmsgsに並べ、並べた数を返す
+// 根から始めて、並べた要素の子を候補に加えていく(候補はheapの添字のヒープとしてcandに持つ)
+// 候補はmax + 1個を超えないので、ヒープ全体を走査せずO(max log max)で済む
+unsigned int stack_heap_first(struct stack_msg **heap, unsigned int size, struct stack_msg **msgs,
+                              unsigned int max, unsigned int *cand)
+{
+    unsigned int n = 0, nr = 0, i, pos, child, last;
+
+    if (size > 0) {
+        cand[nr++] = 0;
+    }
+    while (n < max && nr > 0) {
+        i = cand[0];
+        msgs[n++] = heap[i];
+        // 候補の先頭を取り除く
+        last = cand[--nr];
+        pos = 0;
+        while ((child = 2 * pos + 1) < nr) {
+            if (child + 1 < nr && stack_msg_before(heap[cand[child + 1]], heap[cand[child]])) {
+                child++;
+            }
+            if (!stack_msg_before(heap[cand[child]], heap[last])) {
+                break;
+            }
+            cand[pos] = cand[child];
+            pos = child;
+        }
+        cand[pos] = last;
+        // 並べた要素の子を候補に加える
+        for (child = 2 * i + 1; child <= 2 * i + 2 && child < size; child++) {
+            pos = nr++;
+            while (pos > 0 && stack_msg_before(heap[child], heap[cand[(pos - 1) / 2]])) {
+                cand[pos] = cand[(pos - 1) / 2];
+                pos = (pos - 1) / 2;
+            }
+            cand[pos] = child;
+        }
+    }
+    return n;
+}
+
+// ヒープの中で最後にpopされるメッセージを取り除いて返す
+// 最後にpopされるメッセージは必ず葉にあるので葉だけを探す
+struct stack_msg *stack_heap_remove_last(struct stack_msg **heap, unsigned int size)
+{
+    unsigned int n = size - 1;     // 取り除いた後の要素数
+    struct stack_msg *last = heap[n];
+    struct stack_msg *msg;
+    unsigned int i, worst = n;
+
+    for (i = n / 2; i < n; i++) {
+        if (stack_msg_before(heap[worst], heap[i])) {
+            worst = i;
+        }
+    }
+    msg = heap[worst];
+    // 空いた葉に末尾の要素を移して上に浮かせる
+    i = worst;
+    while (i > 0 && stack_msg_before(last, heap[(i - 1) / 2])) {
+        heap[i] = heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap[i] = last;
+    return msg;
+}
+
+// 以下のリスト操作はLIFOとFIFOのシャードのリストだけを扱う
+// どちらもリストの先頭が次にpopされるメッセージになるように並べる
+
+// リストにメッセージを積む。LIFOでは先頭に、FIFOでは末尾につなぐ
+void stack_list_push(struct list_head *head, struct stack_msg *msg, enum stack_discipline discipline)
+{
+    if (discipline == STACK_LIFO) {
+        list_add(&msg->list, head);
+    } else {
+        list_add_tail(&msg->list, head);
+    }
+}
+
+// 次にpopされるメッセージを返す(取り除かない)。空ならNULLを返す
+struct stack_msg *stack_list_top(struct list_head *head)
+{
+    return list_first_entry_or_null(head, struct stack_msg, list);
+}
+
+// 一番古いメッセージを取り除いて返す(リストは空でないこと)
+// LIFOでは末尾、FIFOでは先頭が一番古い
+struct stack_msg *stack_list_remove_oldest(struct list_head *head, enum stack_discipline discipline)
+{
+    struct stack_msg *msg;
+
+    if (discipline == STACK_LIFO) {
+        msg = list_last_entry(head, struct stack_msg, list);
+    } else {
+        msg = list_first_entry(head, struct stack_msg, list);
+    }
+    list_del(&msg->list);
+    return msg;
+}
+
+// popされる順に先頭からmax個までのメッセージをmsgsに並べ、並べた数を返す
+unsigned int stack_list_first(struct list_head *head, struct stack_msg **msgs, unsigned int max)
+{
+    struct stack_msg *msg;
+    unsigned int n = 0;
+
+    list_for_each_entry(msg, head, list) {
+        if (n == max) {
+            break;
+        }
+        msgs[n++] = msg;
+    }
+    return n;
+}
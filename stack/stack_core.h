@@ -0,0 +1,51 @@
+#ifndef _STACK_CORE_H
+#define _STACK_CORE_H
+
+#include <linux/types.h>
+#include <linux/list.h>
+#include <linux/refcount.h>
+
+// スタックのデータ構造の中核(ヒープとリストの並べ替え)
+// ロックやシャード、デバイスには触れないので、KUnitからハードウェアなしで試せる
+// 呼び出し側がshard->lockを取ってsh->listやsh->heapとsh->depthを渡し、sh->depthを更新する
+
+#define MSG_INLINE_SIZE 64  // この大きさまではメッセージ構造体の中に格納する
+
+// スタックに積むメッセージ
+// 先頭のMSG_INLINE_SIZEバイトは構造体の中に、それを超える部分は
+// ページ単位で確保した領域に格納する(大きなメッセージでも連続領域を必要としない)
+struct stack_msg {
+    struct list_head list;
+    unsigned int shard;     // スロットを予約したシャード番号
+    size_t len;             // メッセージのバイト数
+    size_t charged;         // 積む前にクォータに計上済みのバイト数(通常モードのwriteで計上する)
+    refcount_t ref;         // peek中は参照カウントで解放を遅らせる
+    bool pooled;            // プールから取り出したメッセージか
+    u32 prio;               // 優先度(大きいほど先にpopされる)
+    u64 seq;                // 同じ優先度のメッセージをpushされた順に並べるための番号
+    unsigned int nr_pages;  // 確保済みのページ数
+    struct page **pages;    // MSG_INLINE_SIZEを超える部分を格納するページ
+    char data[MSG_INLINE_SIZE];
+};
+
+// キューの取り出し順
+enum stack_discipline {
+    STACK_LIFO,     // 最後にpushしたものから(スタック)
+    STACK_FIFO,     // 最初にpushしたものから
+    STACK_PRIO,     // 優先度の大きいものから。同じ優先度ならFIFO
+};
+
+bool stack_msg_before(const struct stack_msg *a, const struct stack_msg *b);
+
+void stack_heap_push(struct stack_msg **heap, unsigned int size, struct stack_msg *msg);
+void stack_heap_pop(struct stack_msg **heap, unsigned int size);
+unsigned int stack_heap_first(struct stack_msg **heap, unsigned int size, struct stack_msg **msgs,
+                              unsigned int max, unsigned int *cand);
+struct stack_msg *stack_heap_remove_last(struct stack_msg **heap, unsigned int size);
+
+void stack_list_push(struct list_head *head, struct stack_msg *msg, enum stack_discipline discipline);
+struct stack_msg *stack_list_top(struct list_head *head);
+struct stack_msg *stack_list_remove_oldest(struct list_head *head, enum stack_discipline discipline);
+unsigned int stack_list_first(struct list_head *head, struct stack_msg **msgs, unsigned int max);
+
+#endif
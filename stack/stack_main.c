@@ -0,0 +1,3378 @@
+#include <linux/module.h>
+#include <linux/fs.h>
+#include <linux/platform_device.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+#include <linux/string.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/cache.h>
+#include <linux/smp.h>
+#include <linux/err.h>
+#include <linux/refcount.h>
+#include <linux/compat.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/wait.h>
+#include <linux/log2.h>
+#include <linux/percpu.h>
+#include <linux/device.h>
+#include <linux/poll.h>
+#include <linux/sched/signal.h>
+#include <linux/highmem.h>
+#include <linux/uio.h>
+#include <linux/pagemap.h>
+#include <linux/splice.h>
+#include <linux/cdev.h>
+#include <linux/mutex.h>
+#include <linux/rcupdate.h>
+#include <linux/atomic.h>
+#include <linux/shrinker.h>
+#include <linux/debugfs.h>
+#include <linux/sort.h>
+#include <linux/io_uring.h>
+#include <linux/jump_label.h>
+#include <linux/btf.h>
+#include <linux/btf_ids.h>
+#include <linux/ktime.h>
+#include <linux/cpu.h>
+#include <linux/seq_file.h>
+
+#include "stack.h"
+#include "stack_core.h"
+#include "op_stats.h"
+
+#define CREATE_TRACE_POINTS
+#include "stack_trace.h"
+
+#define DEV_NAME "stack"
+#define STACK_MAX_INSTANCES 64   // 作成できるインスタンス数の上限
+#define STACK_MINORS 2           // 1インスタンスあたりのマイナー番号の数
+#define STACK_MINOR_STREAM 1     // ストリームモード用のマイナー番号(インスタンス内のオフセット)
+
+#define MAX_MSG_NUM 10      // 最大メッセージ数の初期値
+#define MAX_MSG_SIZE 20     // 1メッセージの最大サイズの初期値
+#define MSG_SIZE_LIMIT (4 << 20)    // max_msg_sizeに指定できる上限
+
+// max_msg_sizeは実行時に変更できる
+// 読む側はREAD_ONCEで1回だけ読み、その値で最後まで判定する
+static unsigned int max_msg_size = MAX_MSG_SIZE;
+
+// max_msg_sizeのset関数
+static int stack_set_max_msg_size(const char *val, const struct kernel_param *kp)
+{
+    unsigned int n;
+    int ret;
+
+    ret = kstrtouint(val, 0, &n);
+    if (ret != 0) {
+        return ret;
+    }
+    if (n == 0 || n > MSG_SIZE_LIMIT) {
+        return -EINVAL;
+    }
+    WRITE_ONCE(max_msg_size, n);
+    return 0;
+}
+
+static const struct kernel_param_ops stack_max_msg_size_ops = {
+    .set = stack_set_max_msg_size,
+    .get = param_get_uint,
+};
+module_param_cb(max_msg_size, &stack_max_msg_size_ops, &max_msg_size, 0644);
+MODULE_PARM_DESC(max_msg_size, "maximum size of one message in bytes (writable at runtime)");
+
+// スタック本体はspinlockで保護したリストで持つ
+// シャードモードではCPUごとにシャードを持ち、pushは自CPUのシャードへ、
+// popは自CPUのシャードが空なら他のシャードから取り出す(work-stealing)
+// 優先度キューのときはリストの代わりに配列で持つ二分ヒープを使う
+struct stack_shard {
+    spinlock_t lock;
+    struct list_head list;
+    struct stack_msg **heap;    // 優先度キュー(heap[0]が次にpopされる)
+    unsigned int heap_size;     // heapの要素数
+    u64 seq;                // 次にpushするメッセージの番号
+    unsigned int num;       // 積まれているメッセージ数 + 書き込み中で予約済みのスロット数
+    unsigned int depth;     // 積まれているメッセージ数
+    unsigned int max;       // このシャードに積める最大数(容量の変更で書き換わる)
+} ____cacheline_aligned_in_smp;
+
+static const char * const stack_discipline_names[] = {
+    [STACK_LIFO] = "lifo",
+    [STACK_FIFO] = "fifo",
+    [STACK_PRIO] = "prio",
+};
+
+static bool sharded = false;
+module_param(sharded, bool, 0444);
+MODULE_PARM_DESC(sharded, "use per-CPU stack shards with work-stealing pop");
+
+// debugモジュールパラメータで有効にしたときだけ出力するデバッグ用のprintk
+// 無効のときはstatic keyで分岐ごと飛ばすのでコストはかからない
+static DEFINE_STATIC_KEY_FALSE(stack_debug_key);
+
+#define STACK_DBG(fmt, ...)                                     \
+    do {                                                        \
+        if (static_branch_unlikely(&stack_debug_key)) {         \
+            printk(DEV_NAME ": " fmt, ##__VA_ARGS__);           \
+        }                                                       \
+    } while (0)
+
+// debugのset関数
+static int stack_set_debug(const char *val, const struct kernel_param *kp)
+{
+    bool on;
+    int ret;
+
+    ret = kstrtobool(val, &on);
+    if (ret != 0) {
+        return ret;
+    }
+    if (on) {
+        static_branch_enable(&stack_debug_key);
+    } else {
+        static_branch_disable(&stack_debug_key);
+    }
+    return 0;
+}
+
+// debugのget関数
+static int stack_get_debug(char *buffer, const struct kernel_param *kp)
+{
+    return sprintf(buffer, "%c\n", static_key_enabled(&stack_debug_key) ? 'Y' : 'N');
+}
+
+static const struct kernel_param_ops stack_debug_ops = {
+    .set = stack_set_debug,
+    .get = stack_get_debug,
+};
+module_param_cb(debug, &stack_debug_ops, NULL, 0644);
+MODULE_PARM_DESC(debug, "print debug messages");
+
+static unsigned int instances = 1;
+module_param(instances, uint, 0444);
+MODULE_PARM_DESC(instances, "number of stack instances created at load time");
+
+static unsigned int capacity = MAX_MSG_NUM;
+
+// capacityのset関数
+static int stack_set_capacity(const char *val, const struct kernel_param *kp)
+{
+    unsigned int n;
+    int ret;
+
+    ret = kstrtouint(val, 0, &n);
+    if (ret != 0) {
+        return ret;
+    }
+    if (n == 0) {
+        return -EINVAL;
+    }
+    WRITE_ONCE(capacity, n);
+    return 0;
+}
+
+static const struct kernel_param_ops stack_capacity_ops = {
+    .set = stack_set_capacity,
+    .get = param_get_uint,
+};
+module_param_cb(capacity, &stack_capacity_ops, &capacity, 0644);
+MODULE_PARM_DESC(capacity, "maximum number of messages of new instances (each instance can be resized through sysfs)");
+
+static char *discipline = "lifo";
+module_param(discipline, charp, 0444);
+MODULE_PARM_DESC(discipline, "queue discipline of instances created at load time (lifo, fifo or prio)");
+
+static enum stack_discipline stack_default_discipline;
+
+// インスタンスごとの統計
+struct stack_dev_stat {
+    unsigned long pushed;
+    unsigned long popped;
+    unsigned long dropped;  // drop_oldestやシュリンカで捨てた数
+};
+
+// レイテンシを計測するファイル操作
+enum stack_op {
+    STACK_OP_OPEN,
+    STACK_OP_RELEASE,
+    STACK_OP_READ,
+    STACK_OP_WRITE,
+    STACK_OP_IOCTL,
+    STACK_OP_URING_CMD,
+    STACK_NR_OPS,
+};
+
+static const char * const stack_op_names[] = {
+    [STACK_OP_OPEN] = "open",
+    [STACK_OP_RELEASE] = "release",
+    [STACK_OP_READ] = "read",
+    [STACK_OP_WRITE] = "write",
+    [STACK_OP_IOCTL] = "ioctl",
+    [STACK_OP_URING_CMD] = "uring_cmd",
+};
+
+// インスタンスごと・CPUごとのファイル操作の統計
+struct stack_op_stats {
+    struct op_stats st;
+    u64 depth_hwm;                  // pushした直後の深さの最大値
+};
+
+// バイト数のクォータを超えたときの動作
+enum stack_policy {
+    STACK_POLICY_BLOCK,         // 空くまでpushを待たせる
+    STACK_POLICY_DROP_OLDEST,   // 古いメッセージを捨てて場所を空ける(シュリンカも捨てる)
+    STACK_POLICY_REJECT_NEWEST, // pushを-ENOBUFSで失敗させる
+};
+
+static const char * const stack_policy_names[] = {
+    [STACK_POLICY_BLOCK] = "block",
+    [STACK_POLICY_DROP_OLDEST] = "drop_oldest",
+    [STACK_POLICY_REJECT_NEWEST] = "reject_newest",
+};
+
+static unsigned long max_bytes = 0;
+module_param(max_bytes, ulong, 0644);
+MODULE_PARM_DESC(max_bytes, "byte quota of queued messages of new instances (0 means unlimited)");
+
+// スタックのインスタンス
+// /dev/stackN と /dev/stackN_stream が1つのインスタンスを共有し、
+// キュー・容量・待ちキュー・統計はインスタンスごとに独立している
+// インスタンスはdevの参照カウントで管理し、最後の参照を手放したときに解放する
+// cdevの親もdevなので、開いているファイルの最後のcdev_putが終わるまで解放されない
+struct stack_dev {
+    unsigned int id;
+    struct cdev cdev;                   // マイナー番号2つ分
+    struct device dev;                  // /dev/stackN
+    struct device *stream_dev;          // /dev/stackN_stream
+    struct stack_shard *shards;
+    unsigned int nr_shards;
+    unsigned int capacity;              // 積める最大メッセージ数
+    struct mutex resize_lock;           // 容量の変更を直列化する
+    enum stack_discipline discipline;   // 取り出し順(リングを使うときは常にFIFO)
+    unsigned long max_bytes;            // 積めるメッセージの合計バイト数(0なら無制限)
+    enum stack_policy policy;           // max_bytesを超えたときの動作
+    atomic_long_t bytes;                // 積まれているメッセージと通常モードで書き込み中のメッセージの合計バイト数
+    struct stack_ring *ring;            // NULLのときはリングを使わない
+    wait_queue_head_t read_wq;          // pushを待つ
+    wait_queue_head_t write_wq;         // 空きを待つ
+    struct stack_dev_stat __percpu *stat;
+    struct stack_op_stats __percpu *ops;
+    struct dentry *debugfs;             // debugfsのstackNディレクトリ
+    bool dead;                          // 削除済み(待っている操作は-ENODEVで失敗させる)
+};
+
+static dev_t stack_devt;
+static DEFINE_MUTEX(stack_devs_lock);   // stack_devsの更新とnr_stack_devsを保護する
+// BPFのREDIRECTはロックを取らずにRCUで引き、参照を取ってから使う
+static struct stack_dev __rcu *stack_devs[STACK_MAX_INSTANCES];
+static unsigned int nr_stack_devs;
+
+// ファイルが属するインスタンスを返す
+static struct stack_dev *stack_dev_of(struct file *file)
+{
+    return container_of(file_inode(file)->i_cdev, struct stack_dev, cdev);
+}
+
+// インスタンスの参照を取る
+// 開いているファイルとdebugfsのsnapshotファイルはopenからreleaseまで参照を持つ
+static void stack_dev_get(struct stack_dev *sd)
+{
+    get_device(&sd->dev);
+}
+
+// インスタンスの参照を手放す。最後の参照ならstack_dev_releaseで解放する
+static void stack_dev_put(struct stack_dev *sd)
+{
+    put_device(&sd->dev);
+}
+
+// インスタンスが削除されたか
+// 削除後も開いているファイルからは参照できるが、待たずに-ENODEVを返す
+static bool stack_dead(struct stack_dev *sd)
+{
+    return READ_ONCE(sd->dead);
+}
+
+// stack_devs_lockを持ってi番目のインスタンスを返す
+static struct stack_dev *stack_dev_at(unsigned int i)
+{
+    return rcu_dereference_protected(stack_devs[i], lockdep_is_held(&stack_devs_lock));
+}
+
+// id番目のインスタンスの参照を取って返す。なければNULLを返す
+// 削除はstack_devsから外してRCUの猶予期間を待ってから参照を手放すので、
+// 読み出し側のクリティカルセクション内で見つかれば参照はまだ残っている
+static struct stack_dev *stack_dev_lookup(unsigned int id)
+{
+    struct stack_dev *sd;
+
+    if (id >= STACK_MAX_INSTANCES) {
+        return NULL;
+    }
+    rcu_read_lock();
+    sd = rcu_dereference(stack_devs[id]);
+    if (sd != NULL) {
+        stack_dev_get(sd);
+    }
+    rcu_read_unlock();
+    return sd;
+}
+
+// ファイル操作1回分の統計を自CPUの分に記録する
+// startは操作の開始時刻(ktime_get_ns)、retは操作の戻り値
+static void stack_stat_op(struct stack_dev *sd, enum stack_op op, u64 start, ssize_t ret)
+{
+    BUILD_BUG_ON(STACK_NR_OPS > OP_STATS_MAX_OPS);
+    op_stats_record(&sd->ops->st, op, op == STACK_OP_READ || op == STACK_OP_WRITE, start, ret);
+}
+
+// pushした直後の深さを自CPUの最大値に反映する
+static void stack_stat_depth(struct stack_dev *sd, unsigned int depth)
+{
+    if (depth > this_cpu_read(sd->ops->depth_hwm)) {
+        this_cpu_write(sd->ops->depth_hwm, depth);
+    }
+}
+
+// 自CPUに対応するシャード番号を返す
+static unsigned int stack_local_shard(struct stack_dev *sd)
+{
+    return sd->nr_shards == 1 ? 0 : raw_smp_processor_id() % sd->nr_shards;
+}
+
+// シャードを初期化する
+// インスタンス全体の最大メッセージ数はシャードモードでもcapacityのまま
+// シャードはオンラインのCPUの数だけ作るが、どのシャードにも1つ以上のスロットが
+// 割り当たるようにcapacityを超えない数にする(余ったCPUは剰余で同じシャードを共有する)
+static int stack_shards_init(struct stack_dev *sd)
+{
+    unsigned int i;
+
+    sd->nr_shards = sharded ? clamp(num_online_cpus(), 1U, sd->capacity) : 1;
+    sd->shards = kcalloc(sd->nr_shards, sizeof(*sd->shards), GFP_KERNEL);
+    if (sd->shards == NULL) {
+        return -ENOMEM;
+    }
+    for (i = 0; i < sd->nr_shards; i++) {
+        spin_lock_init(&sd->shards[i].lock);
+        INIT_LIST_HEAD(&sd->shards[i].list);
+        sd->shards[i].max = sd->capacity / sd->nr_shards + (i < sd->capacity % sd->nr_shards);
+        if (sd->discipline == STACK_PRIO && sd->shards[i].max > 0) {
+            sd->shards[i].heap = kcalloc(sd->shards[i].max, sizeof(*sd->shards[i].heap), GFP_KERNEL);
+            if (sd->shards[i].heap == NULL) {
+                return -ENOMEM;
+            }
+            sd->shards[i].heap_size = sd->shards[i].max;
+        }
+    }
+    return 0;
+}
+
+// インスタンスの容量を変更する
+// 新しいヒープはロックの外で確保しておき、シャードのロック中は詰め替えと
+// 差し替えだけを行うのでpush/popを長く止めない
+// 縮めたときに積まれているメッセージは捨てず、popされて容量を下回るまでpushを待たせる
+// スロットが割り当たらないシャードができないように、シャード数より小さくはできない
+static int stack_dev_resize(struct stack_dev *sd, unsigned int cap)
+{
+    struct stack_msg ***heaps;
+    struct stack_msg **old;
+    struct stack_shard *sh;
+    unsigned int i, max;
+    int ret = 0;
+
+    if (cap < sd->nr_shards) {
+        return -EINVAL;
+    }
+    if (sd->ring != NULL) {     // mmap済みのリングの大きさは変えられない
+        return -EOPNOTSUPP;
+    }
+    heaps = kcalloc(sd->nr_shards, sizeof(*heaps), GFP_KERNEL);
+    if (heaps == NULL) {
+        return -ENOMEM;
+    }
+
+    mutex_lock(&sd->resize_lock);
+    // 足りなくなるヒープを先にすべて確保する(途中で失敗したら何も変えない)
+    for (i = 0; sd->discipline == STACK_PRIO && i < sd->nr_shards; i++) {
+        max = cap / sd->nr_shards + (i < cap % sd->nr_shards);
+        if (max > sd->shards[i].heap_size) {
+            heaps[i] = kcalloc(max, sizeof(**heaps), GFP_KERNEL);
+            if (heaps[i] == NULL) {
+                ret = -ENOMEM;
+                goto out;
+            }
+        }
+    }
+    for (i = 0; i < sd->nr_shards; i++) {
+        sh = &sd->shards[i];
+        max = cap / sd->nr_shards + (i < cap % sd->nr_shards);
+        spin_lock(&sh->lock);
+        if (heaps[i] != NULL) {
+            memcpy(heaps[i], sh->heap, sh->depth * sizeof(*sh->heap));
+            old = sh->heap;
+            sh->heap = heaps[i];
+            sh->heap_size = max;
+            heaps[i] = old;     // ロックを外してから解放する
+        }
+        WRITE_ONCE(sh->max, max);
+        spin_unlock(&sh->lock);
+    }
+    WRITE_ONCE(sd->capacity, cap);
+    wake_up_interruptible(&sd->write_wq);  // 空きが増えたかもしれない
+out:
+    mutex_unlock(&sd->resize_lock);
+    for (i = 0; i < sd->nr_shards; i++) {
+        kfree(heaps[i]);
+    }
+    kfree(heaps);
+    return ret;
+}
+
+// メッセージは専用のslabキャッシュから確保する
+// pool_sizeを指定すると起動時にその数だけメッセージ構造体を確保しておき、
+// プールに残っている間は構造体の確保でアロケータを呼ばない
+// プールするのは構造体だけで、MSG_INLINE_SIZEを超える部分のページは
+// メッセージごとに確保して解放する
+static unsigned int pool_size = 0;
+module_param(pool_size, uint, 0444);
+MODULE_PARM_DESC(pool_size, "number of message structs preallocated at load time "
+                 "(payload beyond 64 bytes still allocates pages per message)");
+
+static struct kmem_cache *stack_msg_cache;
+static DEFINE_SPINLOCK(pool_lock);
+static LIST_HEAD(pool_list);
+static unsigned int pool_avail;     // プールに残っているメッセージ数
+
+// メッセージ確保の統計(CPUごとに数えてsysfsで読むときに合計する)
+struct stack_alloc_stat {
+    unsigned long pool;     // プールから確保した数
+    unsigned long slab;     // slabキャッシュから確保した数
+    unsigned long fail;     // 確保に失敗した数
+};
+static DEFINE_PER_CPU(struct stack_alloc_stat, alloc_stat);
+
+// slabキャッシュとプールを用意する
+static int stack_pool_init(void)
+{
+    struct stack_msg *msg;
+    unsigned int i;
+
+    // メッセージはpushしたプロセスのmemcgに課金する
+    // プールのメッセージはモジュールをロードしたプロセスに課金される
+    stack_msg_cache = KMEM_CACHE(stack_msg, SLAB_HWCACHE_ALIGN | SLAB_ACCOUNT);
+    if (stack_msg_cache == NULL) {
+        return -ENOMEM;
+    }
+    for (i = 0; i < pool_size; i++) {
+        msg = kmem_cache_alloc(stack_msg_cache, GFP_KERNEL);
+        if (msg == NULL) {
+            return -ENOMEM;
+        }
+        list_add(&msg->list, &pool_list);
+        pool_avail++;
+    }
+    return 0;
+}
+
+// プールとslabキャッシュを解放する
+static void stack_pool_exit(void)
+{
+    struct stack_msg *msg, *tmp;
+
+    list_for_each_entry_safe(msg, tmp, &pool_list, list) {
+        kmem_cache_free(stack_msg_cache, msg);
+    }
+    INIT_LIST_HEAD(&pool_list);
+    pool_avail = 0;
+    kmem_cache_destroy(stack_msg_cache);
+}
+
+// メッセージを確保する
+// プールに残っていればそれを使い、なければslabキャッシュから確保する
+static struct stack_msg *stack_msg_alloc(void)
+{
+    struct stack_msg *msg = NULL;
+    bool pooled = false;
+
+    if (READ_ONCE(pool_avail) > 0) {
+        spin_lock(&pool_lock);
+        msg = list_first_entry_or_null(&pool_list, struct stack_msg, list);
+        if (msg != NULL) {
+            list_del(&msg->list);
+            pool_avail--;
+            pooled = true;
+        }
+        spin_unlock(&pool_lock);
+    }
+    if (msg == NULL) {
+        msg = kmem_cache_alloc(stack_msg_cache, GFP_KERNEL);
+    }
+
+    if (msg == NULL) {
+        this_cpu_inc(alloc_stat.fail);
+        return NULL;
+    }
+    if (pooled) {
+        this_cpu_inc(alloc_stat.pool);
+    } else {
+        this_cpu_inc(alloc_stat.slab);
+    }
+    msg->shard = 0;
+    msg->len = 0;
+    msg->charged = 0;
+    msg->prio = 0;
+    msg->pooled = pooled;
+    msg->nr_pages = 0;
+    msg->pages = NULL;
+    refcount_set(&msg->ref, 1);
+    return msg;
+}
+
+// メッセージの参照を手放す
+// プールから確保したメッセージはプールに戻す
+static void stack_msg_put(struct stack_msg *msg)
+{
+    unsigned int i;
+
+    if (!refcount_dec_and_test(&msg->ref)) {
+        return;
+    }
+    for (i = 0; i < msg->nr_pages; i++) {
+        __free_page(msg->pages[i]);
+    }
+    kfree(msg->pages);
+    if (msg->pooled) {
+        spin_lock(&pool_lock);
+        list_add(&msg->list, &pool_list);
+        pool_avail++;
+        spin_unlock(&pool_lock);
+    } else {
+        kmem_cache_free(stack_msg_cache, msg);
+    }
+}
+
+// メッセージの格納領域をsizeバイトまで広げる
+static int stack_msg_grow(struct stack_msg *msg, size_t size)
+{
+    struct page **pages;
+    unsigned int need;
+
+    if (size <= MSG_INLINE_SIZE) {
+        return 0;
+    }
+    need = DIV_ROUND_UP(size - MSG_INLINE_SIZE, PAGE_SIZE);
+    if (need <= msg->nr_pages) {
+        return 0;
+    }
+    pages = krealloc_array(msg->pages, need, sizeof(*pages), GFP_KERNEL_ACCOUNT);
+    if (pages == NULL) {
+        return -ENOMEM;
+    }
+    msg->pages = pages;
+    while (msg->nr_pages < need) {
+        pages[msg->nr_pages] = alloc_page(GFP_KERNEL_ACCOUNT);
+        if (pages[msg->nr_pages] == NULL) {
+            return -ENOMEM;
+        }
+        msg->nr_pages++;
+    }
+    return 0;
+}
+
+// メッセージのoffの位置をマップして返す
+// seglenにはそこから連続してアクセスできるバイト数が入る
+static void *stack_msg_map(struct stack_msg *msg, size_t off, size_t *seglen)
+{
+    if (off < MSG_INLINE_SIZE) {
+        *seglen = MSG_INLINE_SIZE - off;
+        return msg->data + off;
+    }
+    off -= MSG_INLINE_SIZE;
+    *seglen = PAGE_SIZE - offset_in_page(off);
+    return kmap_local_page(msg->pages[off >> PAGE_SHIFT]) + offset_in_page(off);
+}
+
+// stack_msg_mapでマップした領域を解放する
+static void stack_msg_unmap(size_t off, void *p)
+{
+    if (off >= MSG_INLINE_SIZE) {
+        kunmap_local(p);
+    }
+}
+
+// iov_iterのデータをメッセージのoffの位置にcountバイトコピーする
+// readv/writevやsplice、io_uringのバッファもこの1つの経路で扱う
+static int stack_msg_copy_from_iter(struct stack_msg *msg, size_t off, struct iov_iter *from, size_t count)
+{
+    size_t seg, n;
+    void *p;
+    int ret;
+
+    ret = stack_msg_grow(msg, off + count);
+    if (ret != 0) {
+        return ret;
+    }
+    while (count > 0) {
+        p = stack_msg_map(msg, off, &seg);
+        seg = min(seg, count);
+        n = copy_from_iter(p, seg, from);
+        stack_msg_unmap(off, p);
+        if (n != seg) {
+            return -EFAULT;
+        }
+        off += seg;
+        count -= seg;
+    }
+    return 0;
+}
+
+// メッセージのoffの位置からcountバイトを0で埋める
+static int stack_msg_clear(struct stack_msg *msg, size_t off, size_t count)
+{
+    size_t seg;
+    void *p;
+    int ret;
+
+    ret = stack_msg_grow(msg, off + count);
+    if (ret != 0) {
+        return ret;
+    }
+    while (count > 0) {
+        p = stack_msg_map(msg, off, &seg);
+        seg = min(seg, count);
+        memset(p, 0, seg);
+        stack_msg_unmap(off, p);
+        off += seg;
+        count -= seg;
+    }
+    return 0;
+}
+
+// メッセージのoffの位置からcountバイトをiov_iterにコピーする
+static int stack_msg_copy_to_iter(struct stack_msg *msg, size_t off, struct iov_iter *to, size_t count)
+{
+    size_t seg, n;
+    void *p;
+
+    while (count > 0) {
+        p = stack_msg_map(msg, off, &seg);
+        seg = min(seg, count);
+        n = copy_to_iter(p, seg, to);
+        stack_msg_unmap(off, p);
+        if (n != seg) {
+            return -EFAULT;
+        }
+        off += seg;
+        count -= seg;
+    }
+    return 0;
+}
+
+// カーネル空間のデータをメッセージの先頭からコピーする
+static int stack_msg_write(struct stack_msg *msg, const void *src, size_t count)
+{
+    size_t off = 0, seg;
+    void *p;
+    int ret;
+
+    ret = stack_msg_grow(msg, count);
+    if (ret != 0) {
+        return ret;
+    }
+    while (off < count) {
+        p = stack_msg_map(msg, off, &seg);
+        seg = min(seg, count - off);
+        memcpy(p, src + off, seg);
+        stack_msg_unmap(off, p);
+        off += seg;
+    }
+    msg->len = count;
+    return 0;
+}
+
+// メッセージ全体をカーネル空間のバッファにコピーする
+static void stack_msg_read(struct stack_msg *msg, void *dst)
+{
+    size_t off = 0, seg;
+    void *p;
+
+    while (off < msg->len) {
+        p = stack_msg_map(msg, off, &seg);
+        seg = min(seg, msg->len - off);
+        memcpy(dst + off, p, seg);
+        stack_msg_unmap(off, p);
+        off += seg;
+    }
+}
+
+// mmapで共有するリングバッファ
+// ring_slotsを指定するとメッセージはシャードではなくこのリングに格納され、
+// ユーザ空間はmmapしたリングに直接push/popできる(FIFO順になる)
+// リングの中身はユーザ空間から書き換えられるので、カーネル側の
+// スロット数などはカーネル内の変数を使い、長さは必ずクランプする
+static unsigned int ring_slots = 0;
+module_param(ring_slots, uint, 0444);
+MODULE_PARM_DESC(ring_slots, "number of slots in the mmap ring (power of two, 0 disables)");
+
+static unsigned int ring_slot_size = 64;
+module_param(ring_slot_size, uint, 0444);
+MODULE_PARM_DESC(ring_slot_size, "bytes per ring slot including its header");
+
+static size_t ring_bytes;           // リング全体のサイズ(全インスタンス共通)
+static u32 ring_mask;               // スロット数 - 1
+
+// カーネル側のpush/popでスロットの確保を試みる回数の上限
+// ユーザ空間がseqを書き換えるとtail/headが進まなくなるので、無限に回らずに-EAGAINを返す
+#define STACK_RING_RETRIES 1024
+
+// posに対応するスロットを返す
+static struct stack_ring_slot *stack_ring_slot(struct stack_dev *sd, u32 pos)
+{
+    return (void *)sd->ring + STACK_RING_SLOT_OFFSET + (size_t)(pos & ring_mask) * ring_slot_size;
+}
+
+// リングのスロットに格納できる1メッセージの最大サイズ
+// max_msg_sizeは実行時に変わるのでpushするときだけ見る
+// popやpeekでは小さくされた後でも、それまでにpushされたメッセージを切り詰めずに取り出す
+static size_t stack_ring_payload(void)
+{
+    return ring_slot_size - sizeof(struct stack_ring_slot);
+}
+
+// リングを確保する
+static int stack_ring_init(struct stack_dev *sd)
+{
+    u32 i;
+
+    if (ring_slots == 0) {
+        return 0;
+    }
+    if (!is_power_of_2(ring_slots) || ring_slot_size % 8 != 0 ||
+        ring_slot_size <= sizeof(struct stack_ring_slot) ||
+        ring_slot_size - sizeof(struct stack_ring_slot) > MSG_SIZE_LIMIT) {
+        return -EINVAL;
+    }
+    ring_mask = ring_slots - 1;
+    ring_bytes = PAGE_ALIGN(STACK_RING_SLOT_OFFSET + (size_t)ring_slots * ring_slot_size);
+    sd->ring = vmalloc_user(ring_bytes);    // ゼロクリア済みのmmap可能な領域
+    if (sd->ring == NULL) {
+        return -ENOMEM;
+    }
+    sd->ring->slots = ring_slots;
+    sd->ring->slot_size = ring_slot_size;
+    sd->ring->slot_offset = STACK_RING_SLOT_OFFSET;
+    for (i = 0; i < ring_slots; i++) {
+        stack_ring_slot(sd, i)->seq = i;
+    }
+    return 0;
+}
+
+// リングにメッセージを積む。満杯のときは-ENOSPCを返す
+// 各スロットのseqでpush/popの順番を決めるロックフリーなMPMCキュー
+// STACK_RING_RETRIES回試しても確保できなければ-EAGAINを返す
+static int stack_ring_push(struct stack_dev *sd, struct stack_msg *msg)
+{
+    struct stack_ring_slot *slot;
+    unsigned int retry;
+    u32 pos, seq;
+
+    if (msg->len > min_t(size_t, stack_ring_payload(), READ_ONCE(max_msg_size))) {
+        return -EMSGSIZE;
+    }
+    pos = READ_ONCE(sd->ring->tail);
+    for (retry = 0; ; retry++) {
+        if (retry == STACK_RING_RETRIES) {
+            return -EAGAIN;
+        }
+        slot = stack_ring_slot(sd, pos);
+        seq = smp_load_acquire(&slot->seq);
+        if (seq == pos) {
+            if (cmpxchg(&sd->ring->tail, pos, pos + 1) == pos) {
+                break;  // スロットを確保できた
+            }
+        } else if ((s32)(seq - pos) < 0) {
+            return -ENOSPC;
+        }
+        pos = READ_ONCE(sd->ring->tail);
+    }
+    stack_msg_read(msg, slot->data);
+    slot->len = msg->len;
+    smp_store_release(&slot->seq, pos + 1);     // popできるように公開する
+    wake_up_interruptible(&sd->read_wq);
+    return 0;
+}
+
+// リングからメッセージを取り出す。空のときはNULLを返す
+// STACK_RING_RETRIES回試しても確保できなければ-EAGAINを返す
+static struct stack_msg *stack_ring_pop(struct stack_dev *sd, size_t limit)
+{
+    struct stack_ring_slot *slot;
+    struct stack_msg *msg;
+    unsigned int retry;
+    u32 pos, seq;
+    size_t len;
+
+    msg = stack_msg_alloc();
+    if (msg == NULL) {
+        return ERR_PTR(-ENOMEM);
+    }
+    pos = READ_ONCE(sd->ring->head);
+    for (retry = 0; ; retry++) {
+        if (retry == STACK_RING_RETRIES) {
+            stack_msg_put(msg);
+            return ERR_PTR(-EAGAIN);
+        }
+        slot = stack_ring_slot(sd, pos);
+        seq = smp_load_acquire(&slot->seq);
+        if (seq == pos + 1) {
+            len = min_t(size_t, READ_ONCE(slot->len), stack_ring_payload());
+            if (len > limit) {
+                stack_msg_put(msg);
+                return ERR_PTR(-EMSGSIZE);
+            }
+            // スロットを確保した後に失敗しないように先に格納領域を確保しておく
+            if (stack_msg_grow(msg, len) != 0) {
+                stack_msg_put(msg);
+                return ERR_PTR(-ENOMEM);
+            }
+            if (cmpxchg(&sd->ring->head, pos, pos + 1) == pos) {
+                break;  // スロットを確保できた
+            }
+        } else if ((s32)(seq - (pos + 1)) < 0) {
+            stack_msg_put(msg);
+            return NULL;
+        }
+        pos = READ_ONCE(sd->ring->head);
+    }
+    len = min_t(size_t, READ_ONCE(slot->len), len);
+    stack_msg_write(msg, slot->data, len);
+    smp_store_release(&slot->seq, pos + ring_mask + 1);    // 次の周回のpushに渡す
+    wake_up_interruptible(&sd->write_wq);
+    return msg;
+}
+
+// リングのidx番目のメッセージを取り出さずにコピーする
+static struct stack_msg *stack_ring_peek(struct stack_dev *sd, unsigned int idx)
+{
+    struct stack_ring_slot *slot;
+    struct stack_msg *msg;
+    u32 pos, seq;
+    size_t len;
+    int retry;
+
+    msg = stack_msg_alloc();
+    if (msg == NULL) {
+        return NULL;
+    }
+    for (retry = 0; retry < 3; retry++) {
+        pos = READ_ONCE(sd->ring->head) + idx;
+        slot = stack_ring_slot(sd, pos);
+        seq = smp_load_acquire(&slot->seq);
+        if (seq != pos + 1) {
+            break;
+        }
+        len = min_t(size_t, READ_ONCE(slot->len), stack_ring_payload());
+        if (stack_msg_write(msg, slot->data, len) != 0) {
+            break;
+        }
+        smp_rmb();
+        if (READ_ONCE(slot->seq) == seq) {  // コピー中にpopされていなければ成功
+            return msg;
+        }
+    }
+    stack_msg_put(msg);
+    return NULL;
+}
+
+// リングに積まれているメッセージ数を返す
+static unsigned int stack_ring_depth(struct stack_dev *sd)
+{
+    u32 n = READ_ONCE(sd->ring->tail) - READ_ONCE(sd->ring->head);
+
+    return min_t(u32, n, ring_slots);
+}
+
+// リングが空でないか
+static bool stack_ring_readable(struct stack_dev *sd)
+{
+    u32 pos = READ_ONCE(sd->ring->head);
+
+    return smp_load_acquire(&stack_ring_slot(sd, pos)->seq) == pos + 1;
+}
+
+// リングに空きがあるか
+static bool stack_ring_writable(struct stack_dev *sd)
+{
+    u32 pos = READ_ONCE(sd->ring->tail);
+
+    return smp_load_acquire(&stack_ring_slot(sd, pos)->seq) == pos;
+}
+
+// STACK_IOC_RING_WAIT: リングが読める/書けるようになるまで寝る
+// ユーザ空間のproducer/consumerはwaitersが0でなければSTACK_IOC_RING_WAKEを呼ぶ
+static int stack_ring_wait(struct stack_dev *sd, u32 what)
+{
+    int ret;
+
+    if (sd->ring == NULL) {
+        return -ENODEV;
+    }
+    // waitersを増やしてから条件を確認することで起床の取りこぼしを防ぐ
+    atomic_inc((atomic_t *)&sd->ring->waiters);
+    smp_mb__after_atomic();
+    if (what == STACK_RING_WAIT_READ) {
+        ret = wait_event_interruptible(sd->read_wq, stack_ring_readable(sd) || stack_dead(sd));
+    } else if (what == STACK_RING_WAIT_WRITE) {
+        ret = wait_event_interruptible(sd->write_wq, stack_ring_writable(sd) || stack_dead(sd));
+    } else {
+        ret = -EINVAL;
+    }
+    atomic_dec((atomic_t *)&sd->ring->waiters);
+    if (ret == 0 && stack_dead(sd)) {
+        ret = -ENODEV;
+    }
+    return ret;
+}
+
+// リングのmmapハンドラ
+static int stack_mmap(struct file *file, struct vm_area_struct *vma)
+{
+    struct stack_dev *sd = stack_dev_of(file);
+
+    if (sd->ring == NULL) {
+        return -ENODEV;
+    }
+    return remap_vmalloc_range(vma, sd->ring, vma->vm_pgoff);
+}
+
+// シャードのスロットを1つ予約する
+static bool stack_shard_reserve(struct stack_shard *sh)
+{
+    bool ok = false;
+
+    if (READ_ONCE(sh->num) >= READ_ONCE(sh->max)) {   // ロックを取る前に満杯なら諦める
+        return false;
+    }
+    spin_lock(&sh->lock);
+    if (sh->num < sh->max) {
+        sh->num++;
+        ok = true;
+    }
+    spin_unlock(&sh->lock);
+    return ok;
+}
+
+// スロットを1つ予約して、予約したシャード番号を返す
+// 自CPUのシャードが満杯なら他のシャードを探す。全部満杯のときは-ENOSPCを返す
+static int stack_reserve(struct stack_dev *sd)
+{
+    unsigned int local = stack_local_shard(sd);
+    unsigned int i, n;
+
+    if (sd->ring != NULL) { // リングの空きはpush時に確認する
+        return 0;
+    }
+    for (i = 0; i < sd->nr_shards; i++) {
+        n = (local + i) % sd->nr_shards;
+        if (stack_shard_reserve(&sd->shards[n])) {
+            return n;
+        }
+    }
+    return -ENOSPC;
+}
+
+// 予約を取り消す
+static void stack_unreserve(struct stack_dev *sd, unsigned int n)
+{
+    if (sd->ring != NULL) {
+        return;
+    }
+    spin_lock(&sd->shards[n].lock);
+    sd->shards[n].num--;
+    spin_unlock(&sd->shards[n].lock);
+    wake_up_interruptible(&sd->write_wq);
+}
+
+// スロットを予約してメッセージを確保する
+static struct stack_msg *stack_msg_new(struct stack_dev *sd)
+{
+    struct stack_msg *msg;
+    int shard;
+
+    shard = stack_reserve(sd);
+    if (shard < 0) {
+        return ERR_PTR(shard);
+    }
+    msg = stack_msg_alloc();
+    if (msg == NULL) {
+        stack_unreserve(sd, shard);
+        return ERR_PTR(-ENOMEM);
+    }
+    msg->shard = shard;
+    return msg;
+}
+
+// pushしなかったメッセージを捨てて予約したスロットとクォータを返す
+static void stack_msg_discard(struct stack_dev *sd, struct stack_msg *msg)
+{
+    if (msg->charged > 0) {
+        atomic_long_sub(msg->charged, &sd->bytes);
+    }
+    stack_unreserve(sd, msg->shard);
+    stack_msg_put(msg);
+}
+
+// 一番古いメッセージを1つ捨てる。捨てるものがなければfalseを返す
+// LIFOではリストの末尾、FIFOでは先頭、優先度キューでは最後にpopされるものを捨てる
+static bool stack_drop_one(struct stack_dev *sd)
+{
+    unsigned int local = stack_local_shard(sd);
+    struct stack_shard *sh;
+    struct stack_msg *msg;
+    unsigned int i;
+
+    for (i = 0; i < sd->nr_shards; i++) {
+        sh = &sd->shards[(local + i) % sd->nr_shards];
+        if (READ_ONCE(sh->depth) == 0) {
+            continue;
+        }
+        spin_lock(&sh->lock);
+        if (sh->depth == 0) {
+            spin_unlock(&sh->lock);
+            continue;
+        }
+        if (sd->discipline == STACK_PRIO) {
+            msg = stack_heap_remove_last(sh->heap, sh->depth);
+        } else {
+            msg = stack_list_remove_oldest(&sh->list, sd->discipline);
+        }
+        sh->depth--;
+        sh->num--;
+        spin_unlock(&sh->lock);
+        atomic_long_sub(msg->len, &sd->bytes);
+        this_cpu_inc(sd->stat->dropped);
+        stack_msg_put(msg);
+        wake_up_interruptible(&sd->write_wq);
+        return true;
+    }
+    return false;
+}
+
+// lenバイトをクォータに計上する
+// 超えるときはpolicyに従って古いメッセージを捨てるかエラーを返す
+// -ENOSPCのときはstack_push_waitが空くまで待つ
+static int stack_charge(struct stack_dev *sd, size_t len)
+{
+    unsigned long max = READ_ONCE(sd->max_bytes);
+
+    if (max == 0) {
+        atomic_long_add(len, &sd->bytes);
+        return 0;
+    }
+    if (len > max) {   // クォータより大きいメッセージは積めない
+        return -EMSGSIZE;
+    }
+    for (;;) {
+        if ((unsigned long)atomic_long_add_return(len, &sd->bytes) <= max) {
+            return 0;
+        }
+        atomic_long_sub(len, &sd->bytes);
+        switch (READ_ONCE(sd->policy)) {
+        case STACK_POLICY_DROP_OLDEST:
+            if (stack_drop_one(sd)) {
+                continue;
+            }
+            return -ENOSPC;     // 捨てられるものがない(他のpushが積み終わるのを待つ)
+        case STACK_POLICY_REJECT_NEWEST:
+            return -ENOBUFS;
+        default:
+            return -ENOSPC;
+        }
+    }
+}
+
+// lenバイトのメッセージをクォータ内に積めるか
+static bool stack_fits(struct stack_dev *sd, size_t len)
+{
+    unsigned long max = READ_ONCE(sd->max_bytes);
+
+    return max == 0 || (unsigned long)atomic_long_read(&sd->bytes) + len <= max;
+}
+
+// 積むメッセージをクォータに計上する
+// writeで計上済みの分は差し引き、計上済みの方が多ければ(書き直して短くなった)余りを返す
+// 以降はmsg->lenが計上されている状態になる
+static int stack_charge_msg(struct stack_dev *sd, struct stack_msg *msg)
+{
+    int ret;
+
+    if (msg->charged < msg->len) {
+        ret = stack_charge(sd, msg->len - msg->charged);
+        if (ret != 0) {
+            return ret;
+        }
+    } else if (msg->charged > msg->len) {
+        atomic_long_sub(msg->charged - msg->len, &sd->bytes);
+    }
+    msg->charged = 0;
+    return 0;
+}
+
+static unsigned int stack_depth(struct stack_dev *sd);
+
+// 予約済みのスロットにメッセージを積む
+// 成功したときはメッセージの所有権はスタックに移る
+// リングを使うときはユーザ空間のpushで満杯になっていることがある
+static int stack_enqueue(struct stack_dev *sd, struct stack_msg *msg)
+{
+    struct stack_shard *sh = &sd->shards[msg->shard];
+    unsigned int depth;
+    int ret;
+
+    if (sd->ring != NULL) {
+        ret = stack_ring_push(sd, msg);
+        if (ret == 0) {
+            stack_stat_depth(sd, stack_ring_depth(sd));
+            if (trace_stack_push_enabled()) {
+                trace_stack_push(sd->id, msg->len, msg->prio, stack_depth(sd));
+            }
+            stack_msg_put(msg);
+            this_cpu_inc(sd->stat->pushed);
+        }
+        return ret;
+    }
+
+    ret = stack_charge_msg(sd, msg);
+    if (ret != 0) {
+        return ret;
+    }
+    spin_lock(&sh->lock);
+    if (sd->discipline == STACK_PRIO) {
+        msg->seq = sh->seq++;
+        stack_heap_push(sh->heap, sh->depth, msg);
+    } else {
+        stack_list_push(&sh->list, msg, sd->discipline);
+    }
+    depth = ++sh->depth;
+    spin_unlock(&sh->lock);
+    // シャードを使うときは他CPUのシャードを読みに行かず、積んだシャードの深さを記録する
+    stack_stat_depth(sd, depth);
+    this_cpu_inc(sd->stat->pushed);
+    if (trace_stack_push_enabled()) {
+        trace_stack_push(sd->id, msg->len, msg->prio, stack_depth(sd));
+    }
+    wake_up_interruptible(&sd->read_wq);
+    return 0;
+}
+
+// push時に呼ばれるBPFプログラムに渡す情報
+// BPFプログラムはBTFを通してこの構造体を読める
+struct stack_bpf_ctx {
+    u32 instance;           // pushされたインスタンスの番号
+    u32 len;                // メッセージのバイト数
+    u32 prio;               // メッセージの優先度
+    u32 data_len;           // dataから直接読めるバイト数
+    const char *data;       // メッセージの先頭(残りはbpf_stack_msg_readで読む)
+    struct stack_msg *msg;
+};
+
+// bpf_hookモジュールパラメータで有効にしたときだけpushでBPFフックを呼ぶ
+// 無効のときはstatic keyでフックの呼び出しごと飛ばすのでオーバーヘッドはない
+// アタッチしただけでは有効にならないので、BPFプログラムを使うときはbpf_hookを1にする
+static DEFINE_STATIC_KEY_FALSE(stack_bpf_key);
+static bool bpf_hook = false;
+static bool stack_bpf_ready;    // static keyを切り替えてよいか(モジュールの初期化後)
+
+// bpf_hookのset関数
+static int stack_set_bpf_hook(const char *val, const struct kernel_param *kp)
+{
+    bool on;
+    int ret;
+
+    ret = kstrtobool(val, &on);
+    if (ret != 0) {
+        return ret;
+    }
+    if (stack_bpf_ready && on != bpf_hook) {
+        if (on) {
+            static_branch_enable(&stack_bpf_key);
+        } else {
+            static_branch_disable(&stack_bpf_key);
+        }
+    }
+    bpf_hook = on;
+    return 0;
+}
+
+static const struct kernel_param_ops stack_bpf_hook_ops = {
+    .set = stack_set_bpf_hook,
+    .get = param_get_bool,
+};
+module_param_cb(bpf_hook, &stack_bpf_hook_ops, &bpf_hook, 0644);
+MODULE_PARM_DESC(bpf_hook, "call stack_bpf_push_hook on every push so that fmod_ret BPF programs can filter messages "
+                 "(programs attached while this is 0 are never run)");
+
+// 6.3より前のカーネルには__bpf_kfuncがないので、同じ属性を付ける
+#ifndef __bpf_kfunc
+#define __bpf_kfunc __used noinline
+#endif
+
+// 以下の関数はBTFから呼ばれるだけでヘッダに宣言を置かない
+__diag_push();
+__diag_ignore_all("-Wmissing-prototypes",
+                  "Global functions as their definitions will be in stack.ko BTF");
+
+// BPFプログラム(fmod_ret)をアタッチするための関数
+// 戻り値はSTACK_BPF_VERDICTで作った判定。何もアタッチされていなければそのまま積む
+// __weakにして、コンパイラが戻り値を定数と見て呼び出し側を畳み込まないようにする
+__weak noinline int stack_bpf_push_hook(struct stack_bpf_ctx *ctx)
+{
+    return STACK_BPF_PASS;
+}
+
+// BPFプログラムからメッセージのoffバイト目からbuf__szバイトを読むkfunc
+// 読めたバイト数を返す
+__bpf_kfunc int bpf_stack_msg_read(const struct stack_bpf_ctx *ctx, u32 off, void *buf, u32 buf__sz)
+{
+    struct stack_msg *msg = ctx->msg;
+    size_t done = 0, n, seglen;
+    void *p;
+
+    if (off >= msg->len) {
+        return 0;
+    }
+    buf__sz = min_t(size_t, buf__sz, msg->len - off);
+    while (done < buf__sz) {
+        p = stack_msg_map(msg, off + done, &seglen);
+        n = min(seglen, buf__sz - done);
+        memcpy(buf + done, p, n);
+        stack_msg_unmap(off + done, p);
+        done += n;
+    }
+    return done;
+}
+
+__diag_pop();
+
+BTF_SET8_START(stack_bpf_fmodret_ids)
+BTF_ID_FLAGS(func, stack_bpf_push_hook)
+BTF_SET8_END(stack_bpf_fmodret_ids)
+
+static const struct btf_kfunc_id_set stack_bpf_fmodret_set = {
+    .owner = THIS_MODULE,
+    .set   = &stack_bpf_fmodret_ids,
+};
+
+BTF_SET8_START(stack_bpf_kfunc_ids)
+BTF_ID_FLAGS(func, bpf_stack_msg_read)
+BTF_SET8_END(stack_bpf_kfunc_ids)
+
+static const struct btf_kfunc_id_set stack_bpf_kfunc_set = {
+    .owner = THIS_MODULE,
+    .set   = &stack_bpf_kfunc_ids,
+};
+
+// BPFプログラムの判定に従ってメッセージを処理する
+// そのまま積むときは1を返す。捨てたり別のインスタンスに積んだときは0を、
+// 積めなかったときは負のエラー番号を返す(メッセージの所有権は呼び出し元に残る)
+static int stack_bpf_run(struct stack_dev *sd, struct stack_msg *msg)
+{
+    struct stack_bpf_ctx ctx = {
+        .instance = sd->id,
+        .len = msg->len,
+        .prio = msg->prio,
+        .data_len = min_t(size_t, msg->len, MSG_INLINE_SIZE),
+        .data = msg->data,
+        .msg = msg,
+    };
+    struct stack_dev *dst;
+    unsigned int shard;
+    size_t charged;
+    u32 verdict, arg;
+    int n, ret;
+
+    verdict = stack_bpf_push_hook(&ctx);
+    arg = verdict >> STACK_BPF_ARG_SHIFT;
+    switch (verdict & STACK_BPF_VERDICT_MASK) {
+    case STACK_BPF_DROP:
+        stack_msg_discard(sd, msg);
+        this_cpu_inc(sd->stat->dropped);
+        return 0;
+    case STACK_BPF_TAG:
+        msg->prio = arg;
+        return 1;
+    case STACK_BPF_REDIRECT:
+        if (arg == sd->id) {
+            return 1;
+        }
+        // 転送先は使い終わるまで参照を持ち、削除済みならそのまま積む
+        dst = stack_dev_lookup(arg);
+        if (dst == NULL) {
+            return 1;
+        }
+        if (stack_dead(dst)) {
+            stack_dev_put(dst);
+            return 1;
+        }
+        // 転送先では待たずにスロットを予約し、積めなければ-ENOBUFSを返す
+        n = stack_reserve(dst);
+        if (n < 0) {
+            stack_dev_put(dst);
+            return -ENOBUFS;
+        }
+        // writeで計上済みのクォータは元のインスタンスの分なので、転送先では全体を計上する
+        shard = msg->shard;
+        charged = msg->charged;
+        msg->shard = n;
+        msg->charged = 0;
+        ret = stack_enqueue(dst, msg);
+        if (ret != 0) {
+            msg->shard = shard;
+            msg->charged = charged;
+            stack_unreserve(dst, n);
+            stack_dev_put(dst);
+            return ret == -ENOSPC ? -ENOBUFS : ret;
+        }
+        stack_dev_put(dst);
+        if (charged > 0) {
+            atomic_long_sub(charged, &sd->bytes);
+        }
+        stack_unreserve(sd, shard);
+        return 0;
+    default:
+        return 1;
+    }
+}
+
+// 予約済みのスロットにメッセージを積む
+// 成功したときはメッセージの所有権はスタックに移る
+// BPFフックが有効なときは判定に従って捨てたり別のインスタンスに積んだりする
+static int stack_push(struct stack_dev *sd, struct stack_msg *msg)
+{
+    int ret;
+
+    if (static_branch_unlikely(&stack_bpf_key)) {
+        ret = stack_bpf_run(sd, msg);
+        if (ret <= 0) {
+            return ret;
+        }
+    }
+    return stack_enqueue(sd, msg);
+}
+
+// シャードの一番上のメッセージを取り出す
+// メッセージがlimitバイトより大きいときは取り出さずに-EMSGSIZEを返す
+static struct stack_msg *stack_shard_pop(struct stack_dev *sd, struct stack_shard *sh, size_t limit)
+{
+    struct stack_msg *msg;
+
+    if (READ_ONCE(sh->depth) == 0) {   // ロックを取る前に空なら諦める
+        return NULL;
+    }
+    spin_lock(&sh->lock);
+    if (sd->discipline == STACK_PRIO) {
+        msg = sh->depth > 0 ? sh->heap[0] : NULL;
+    } else {
+        msg = stack_list_top(&sh->list);
+    }
+    if (msg != NULL && msg->len > limit) {
+        msg = ERR_PTR(-EMSGSIZE);
+    } else if (msg != NULL) {
+        if (sd->discipline == STACK_PRIO) {
+            stack_heap_pop(sh->heap, sh->depth);
+        } else {
+            list_del(&msg->list);
+        }
+        sh->depth--;
+        sh->num--;  // 取り出したのでスロットを返却
+        atomic_long_sub(msg->len, &sd->bytes);
+    }
+    spin_unlock(&sh->lock);
+    return msg;
+}
+
+// 一番上のメッセージを取り出す。空のときはNULLを返す
+// 自CPUのシャードが空なら他のシャードから取り出す
+static struct stack_msg *stack_pop(struct stack_dev *sd, size_t limit)
+{
+    unsigned int local = stack_local_shard(sd);
+    struct stack_msg *msg;
+    unsigned int i;
+
+    if (sd->ring != NULL) {
+        msg = stack_ring_pop(sd, limit);
+        if (!IS_ERR_OR_NULL(msg)) {
+            this_cpu_inc(sd->stat->popped);
+            if (trace_stack_pop_enabled()) {
+                trace_stack_pop(sd->id, msg->len, msg->prio, stack_depth(sd));
+            }
+        }
+        return msg;
+    }
+    for (i = 0; i < sd->nr_shards; i++) {
+        msg = stack_shard_pop(sd, &sd->shards[(local + i) % sd->nr_shards], limit);
+        if (msg != NULL) {
+            if (!IS_ERR(msg)) {
+                this_cpu_inc(sd->stat->popped);
+                if (trace_stack_pop_enabled()) {
+                    trace_stack_pop(sd->id, msg->len, msg->prio, stack_depth(sd));
+                }
+            }
+            wake_up_interruptible(&sd->write_wq);
+            return msg;
+        }
+    }
+    return NULL;
+}
+
+// popされる順に先頭からmax個までのメッセージを取り出さずに参照し、参照できた数を返す
+// シャードごとにロックを1回だけ取り、リストは先頭から、ヒープは先頭側だけを辿る
+// candは優先度キューのときの作業領域(max + 1個分)。使い終わったら各メッセージをstack_msg_putすること
+static unsigned int stack_peek(struct stack_dev *sd, struct stack_msg **msgs, unsigned int max, unsigned int *cand)
+{
+    unsigned int local = stack_local_shard(sd);
+    struct stack_shard *sh;
+    struct stack_msg *msg;
+    unsigned int i, j, start, n = 0;
+
+    if (sd->ring != NULL) {
+        while (n < max && (msg = stack_ring_peek(sd, n)) != NULL) {
+            msgs[n++] = msg;
+        }
+        return n;
+    }
+    for (i = 0; i < sd->nr_shards && n < max; i++) {
+        sh = &sd->shards[(local + i) % sd->nr_shards];
+        if (READ_ONCE(sh->depth) == 0) {   // ロックを取る前に空なら次へ
+            continue;
+        }
+        spin_lock(&sh->lock);
+        start = n;
+        if (sd->discipline == STACK_PRIO) {
+            n += stack_heap_first(sh->heap, sh->depth, &msgs[n], max - n, cand);
+        } else {
+            n += stack_list_first(&sh->list, &msgs[n], max - n);
+        }
+        for (j = start; j < n; j++) {
+            refcount_inc(&msgs[j]->ref);
+        }
+        spin_unlock(&sh->lock);
+    }
+    return n;
+}
+
+// 積まれているメッセージ数を返す
+static unsigned int stack_depth(struct stack_dev *sd)
+{
+    unsigned int i, depth = 0;
+
+    if (sd->ring != NULL) {
+        return stack_ring_depth(sd);
+    }
+    for (i = 0; i < sd->nr_shards; i++) {
+        depth += READ_ONCE(sd->shards[i].depth);
+    }
+    return depth;
+}
+
+// popできるメッセージがあるか
+static bool stack_readable(struct stack_dev *sd)
+{
+    if (sd->ring != NULL) {
+        return stack_ring_readable(sd);
+    }
+    return stack_depth(sd) > 0;
+}
+
+// pushできる空きがあるか
+static bool stack_writable(struct stack_dev *sd)
+{
+    unsigned int i;
+
+    if (sd->ring != NULL) {
+        return stack_ring_writable(sd);
+    }
+    if (!stack_fits(sd, 1)) {
+        return false;
+    }
+    for (i = 0; i < sd->nr_shards; i++) {
+        if (READ_ONCE(sd->shards[i].num) < READ_ONCE(sd->shards[i].max)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// スロットを予約してメッセージを確保する。満杯のときは空くまで寝る
+// nonblockのときは寝ずに-EAGAINを返す。インスタンスが削除されたら-ENODEVを返す
+static struct stack_msg *stack_msg_new_wait(struct stack_dev *sd, bool nonblock)
+{
+    struct stack_msg *msg;
+    int ret;
+
+    for (;;) {
+        if (stack_dead(sd)) {
+            return ERR_PTR(-ENODEV);
+        }
+        msg = stack_msg_new(sd);
+        if (!IS_ERR(msg) || PTR_ERR(msg) != -ENOSPC) {
+            return msg;
+        }
+        if (nonblock) {
+            return ERR_PTR(-EAGAIN);
+        }
+        ret = wait_event_interruptible(sd->write_wq, stack_writable(sd) || stack_dead(sd));
+        if (ret != 0) {
+            return ERR_PTR(ret);
+        }
+    }
+}
+
+// メッセージを積む。リングが満杯のときやクォータを超えるときは空くまで寝る
+// スロットは予約済みなのでstack_writableではなく積めるかどうかを直接待つ
+// 削除されたインスタンスには積まずに-ENODEVを返す
+static int stack_push_wait(struct stack_dev *sd, struct stack_msg *msg, bool nonblock)
+{
+    int ret;
+
+    for (;;) {
+        if (stack_dead(sd)) {
+            return -ENODEV;
+        }
+        ret = stack_push(sd, msg);
+        if (ret != -ENOSPC) {
+            return ret;
+        }
+        if (nonblock) {
+            return -EAGAIN;
+        }
+        ret = wait_event_interruptible(sd->write_wq, stack_dead(sd) ||
+                                       (sd->ring != NULL ? stack_ring_writable(sd) : stack_fits(sd, msg->len)));
+        if (ret != 0) {
+            return ret;
+        }
+    }
+}
+
+// 通常モードで書き込み中のメッセージをendバイトまでクォータに計上する
+// 超えるときはpolicyに従い、blockなら空くまで寝る(nonblockのときは-EAGAINを返す)
+// releaseで積むときに失敗してもclose()には伝わらないので、writeの時点でエラーを返す
+static int stack_msg_charge_wait(struct stack_dev *sd, struct stack_msg *msg, size_t end, bool nonblock)
+{
+    unsigned long max = READ_ONCE(sd->max_bytes);
+    int ret;
+
+    if (sd->ring != NULL || end <= msg->charged) {  // リングはクォータの対象外
+        return 0;
+    }
+    if (max != 0 && end > max) {   // クォータより大きいメッセージは積めない
+        return -EMSGSIZE;
+    }
+    for (;;) {
+        if (stack_dead(sd)) {
+            return -ENODEV;
+        }
+        ret = stack_charge(sd, end - msg->charged);
+        if (ret == 0) {
+            msg->charged = end;
+            return 0;
+        }
+        if (ret != -ENOSPC) {
+            return ret;
+        }
+        if (nonblock) {
+            return -EAGAIN;
+        }
+        ret = wait_event_interruptible(sd->write_wq, stack_fits(sd, end - msg->charged) || stack_dead(sd));
+        if (ret != 0) {
+            return ret;
+        }
+    }
+}
+
+// メッセージを取り出す。空のときはpushされるまで寝る
+// 削除されたインスタンスでは残っているメッセージを取り出し、空になったら-ENODEVを返す
+static struct stack_msg *stack_pop_wait(struct stack_dev *sd, size_t limit, bool nonblock)
+{
+    struct stack_msg *msg;
+    int ret;
+
+    for (;;) {
+        msg = stack_pop(sd, limit);
+        if (msg != NULL) {
+            return msg;
+        }
+        if (stack_dead(sd)) {
+            return ERR_PTR(-ENODEV);
+        }
+        if (nonblock) {
+            return ERR_PTR(-EAGAIN);
+        }
+        ret = wait_event_interruptible(sd->read_wq, stack_readable(sd) || stack_dead(sd));
+        if (ret != 0) {
+            return ERR_PTR(ret);
+        }
+    }
+}
+
+// ストリームモードでファイルごとに持つ状態
+// writeで途中まで受信したフレームを次のwriteに、
+// readで途中まで送信したフレームを次のreadに持ち越す
+struct stack_stream {
+    struct stack_frame hdr;     // 受信中のフレームヘッダ
+    size_t hdr_len;             // 受信済みのヘッダのバイト数
+    struct stack_msg *msg;      // 受信中のメッセージ(スロット予約済み)
+    size_t skip;                // 捨てたフレームの本体のうち読み捨てる残りのバイト数
+    int err;                    // 捨てたフレームのエラー(次のwriteで返す)
+    struct stack_msg *rmsg;     // 送信中のメッセージ(pop済み)
+    size_t roff;                // 送信済みのバイト数(ヘッダ込み)
+};
+
+static const struct file_operations stack_fops;
+static const struct file_operations stack_stream_fops;
+
+// 待たずに返すべき呼び出しか(O_NONBLOCKかio_uringなどからのIOCB_NOWAIT)
+static bool stack_nonblock(struct kiocb *iocb)
+{
+    return (iocb->ki_filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
+}
+
+// 通常モードのopen
+// 書き込み時はスロットを予約し、読み込み時はメッセージをpopしておく
+static int stack_open_msg(struct stack_dev *sd, struct file *file)
+{
+    struct stack_msg *msg;
+
+    if (file->f_mode & FMODE_WRITE) { // 書き込み時のとき
+        // スタックが満杯時は空くまで待つ(O_NONBLOCKのときは-EAGAINを返す)
+        msg = stack_msg_new_wait(sd, file->f_flags & O_NONBLOCK);
+        if (IS_ERR(msg)) {
+            return PTR_ERR(msg);
+        }
+        // 受信したメッセージのポインタをfile構造体のprivate_dataにセット
+        // そうすることでread, releaseハンドラでメッセージを取り出す
+        file->private_data = msg;
+    } else if (file->f_mode & FMODE_READ) {
+        // スタックが空のときはpushされるまで待つ(O_NONBLOCKのときは-EAGAINを返す)
+        msg = stack_pop_wait(sd, SIZE_MAX, file->f_flags & O_NONBLOCK);
+        if (IS_ERR(msg)) {
+            return PTR_ERR(msg);
+        }
+        file->private_data = msg;
+    } else {
+        return -EINVAL;
+    }
+
+    file->f_mode |= FMODE_NOWAIT;   // IOCB_NOWAITに対応している
+    return 0;
+}
+
+// openハンドラ
+static int stack_open(struct inode *inode, struct file *file)
+{
+    struct stack_dev *sd = container_of(inode->i_cdev, struct stack_dev, cdev);
+    bool stream = (iminor(inode) - MINOR(stack_devt)) % STACK_MINORS == STACK_MINOR_STREAM;
+    u64 start = ktime_get_ns();
+    int ret;
+
+    trace_stack_open(sd->id, stream, file->f_mode);
+    stack_dev_get(sd);  // releaseまでインスタンスを解放させない
+
+    // ストリームモードのとき
+    if (stream) {
+        replace_fops(file, &stack_stream_fops);
+        ret = file->f_op->open(inode, file);
+    } else {
+        ret = stack_open_msg(sd, file);
+    }
+    stack_stat_op(sd, STACK_OP_OPEN, start, ret);
+    if (ret != 0) {
+        stack_dev_put(sd);
+    }
+    return ret;
+}
+
+// releaseハンドラ
+static int stack_release(struct inode *inode, struct file *file)
+{
+    // ファイル構造体のprivate_dataに記録していた
+    // メッセージのアドレスを取り出す
+    struct stack_msg *msg = file->private_data;
+    struct stack_dev *sd = stack_dev_of(file);
+    u64 start = ktime_get_ns();
+    int ret = 0;
+
+    if (file->f_mode & FMODE_WRITE) {   // 書き込み時
+        ret = stack_push_wait(sd, msg, file->f_flags & O_NONBLOCK);
+        if (ret != 0) { // pushできなかったときはメッセージを捨ててエラーを返す
+            stack_msg_discard(sd, msg);
+        }
+    } else {    // 読み込み時
+        stack_msg_put(msg);
+    }
+
+    trace_stack_release(sd->id, ret);
+    stack_stat_op(sd, STACK_OP_RELEASE, start, ret);
+    stack_dev_put(sd);
+    return ret;
+}
+
+// 通常モードのwrite
+// 書き込み中のメッセージのファイル位置にデータを追加する
+static ssize_t stack_write_msg(struct stack_dev *sd, struct kiocb *iocb, struct iov_iter *from)
+{
+    // ファイル構造体のprivate_dataに記録していた
+    // メッセージのアドレスを取り出す
+    struct stack_msg *msg = iocb->ki_filp->private_data;
+    size_t max = READ_ONCE(max_msg_size);
+    size_t count = iov_iter_count(from);
+    int ret;
+
+    if (iocb->ki_pos >= max) { // メッセージが最大サイズの場合はエラーを返す
+        return -ENOSPC;
+    }
+    if (count > max - iocb->ki_pos) {
+        count = max - iocb->ki_pos;
+    }
+    // 書き込んだ時点でクォータに計上しておき、releaseで積むときには失敗しないようにする
+    ret = stack_msg_charge_wait(sd, msg, iocb->ki_pos + count, stack_nonblock(iocb));
+    if (ret != 0) {
+        return ret;
+    }
+    // pwriteなどでメッセージの末尾より先に書き込むときは間を0で埋める
+    // (初期化していないslabやページの中身をreadで読み出せないようにする)
+    if (iocb->ki_pos > msg->len) {
+        ret = stack_msg_clear(msg, msg->len, iocb->ki_pos - msg->len);
+        if (ret != 0) {
+            return ret;
+        }
+    }
+    // ユーザ空間のメッセージデータをカーネル空間にコピー
+    ret = stack_msg_copy_from_iter(msg, iocb->ki_pos, from, count);
+    if (ret != 0) {
+        return ret;
+    }
+    iocb->ki_pos += count; // データ取得した分だけファイルポインタを進める
+    msg->len = iocb->ki_pos;
+    STACK_DBG("message len is %zu\n", msg->len);
+
+    return count;   // 取得したデータサイズを返す
+}
+
+// writeハンドラ
+// write/writev/io_uring/spliceからの書き込みをすべてiov_iterで受け取る
+static ssize_t stack_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct stack_dev *sd = stack_dev_of(iocb->ki_filp);
+    size_t count = iov_iter_count(from);
+    loff_t pos = iocb->ki_pos;
+    u64 start = ktime_get_ns();
+    ssize_t ret;
+
+    ret = stack_write_msg(sd, iocb, from);
+    trace_stack_write(sd->id, count, pos, ret);
+    stack_stat_op(sd, STACK_OP_WRITE, start, ret);
+    return ret;
+}
+
+// 通常モードのread
+// open時にpopしたメッセージをファイル位置から読み出す
+static ssize_t stack_read_msg(struct kiocb *iocb, struct iov_iter *to)
+{
+    size_t len, count = iov_iter_count(to);
+    struct stack_msg *msg = iocb->ki_filp->private_data;
+    int ret;
+
+    len = msg->len; // メッセージサイズを取得
+    if (iocb->ki_pos >= len) { // メッセージがすべて転送された
+        return 0;
+    }
+    if (count > len - iocb->ki_pos) {
+        count = len - iocb->ki_pos;
+    }
+    // カーネル空間からユーザ空間にメッセージデータをコピー
+    // 大きなメッセージも任意のサイズに分けて読み出せる
+    ret = stack_msg_copy_to_iter(msg, iocb->ki_pos, to, count);
+    if (ret != 0) {
+        return ret;
+    }
+    iocb->ki_pos += count;
+
+    return count;   // 転送したデータサイズを返す
+}
+
+// readハンドラ
+// read/readv/io_uring/spliceへの読み出しをすべてiov_iterで返す
+static ssize_t stack_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct stack_dev *sd = stack_dev_of(iocb->ki_filp);
+    size_t count = iov_iter_count(to);
+    loff_t pos = iocb->ki_pos;
+    u64 start = ktime_get_ns();
+    ssize_t ret;
+
+    ret = stack_read_msg(iocb, to);
+    trace_stack_read(sd->id, count, pos, ret);
+    stack_stat_op(sd, STACK_OP_READ, start, ret);
+    return ret;
+}
+
+// ストリームモードのopenハンドラ
+// 1つのファイルディスクリプタで何個でもpush/popできる
+static int stack_stream_open(struct inode *inode, struct file *file)
+{
+    struct stack_stream *st;
+
+    st = kzalloc(sizeof(*st), GFP_KERNEL_ACCOUNT);
+    if (st == NULL) {
+        return -ENOMEM;
+    }
+    file->private_data = st;
+    file->f_mode |= FMODE_NOWAIT;   // IOCB_NOWAITに対応している
+    return stream_open(inode, file);    // ファイル位置を持たないストリームとして開く
+}
+
+// ストリームモードのreleaseハンドラ
+static int stack_stream_release(struct inode *inode, struct file *file)
+{
+    struct stack_stream *st = file->private_data;
+    struct stack_dev *sd = stack_dev_of(file);
+    u64 start = ktime_get_ns();
+
+    // 受信途中のメッセージは捨てて予約したスロットを返す
+    if (st->msg != NULL) {
+        stack_msg_discard(sd, st->msg);
+    }
+    // 送信途中のメッセージは残りを捨てる
+    if (st->rmsg != NULL) {
+        stack_msg_put(st->rmsg);
+    }
+    kfree(st);
+    trace_stack_release(sd->id, 0);
+    stack_stat_op(sd, STACK_OP_RELEASE, start, 0);
+    stack_dev_put(sd);
+    return 0;
+}
+
+// 捨てたフレームの本体を最大maxバイト読み捨て、読み捨てたバイト数を返す
+static size_t stack_stream_skip(struct stack_stream *st, struct iov_iter *from, size_t max)
+{
+    size_t n = min(st->skip, max);
+
+    iov_iter_advance(from, n);
+    st->skip -= n;
+    return n;
+}
+
+// フレームを捨ててwriteを終える。doneバイトまで受信済みで、そのうち先頭のprevバイトは前のフレームの分
+// 捨てたフレームより前に受け付けたフレームがあればその分を返し、エラーは次のwriteで返す
+static ssize_t stack_stream_reject(struct stack_stream *st, struct iov_iter *from, size_t count,
+                                   size_t done, size_t prev, int err)
+{
+    done += stack_stream_skip(st, from, count - done);
+    if (prev == 0) {
+        return err;
+    }
+    st->err = err;
+    return done;
+}
+
+// 「ヘッダ + メッセージ」の並びを受け取り、完成したメッセージから順にpushする
+// フレームがwriteの境界をまたいでもよい
+// 積めないフレームは本体を読み捨て、ストリームの区切りがずれないようにする
+// ストリームモードのwriteとスナップショットの復元で使う
+static ssize_t stack_stream_write(struct stack_dev *sd, struct stack_stream *st, struct iov_iter *from, bool nonblock)
+{
+    size_t count = iov_iter_count(from);
+    struct stack_msg *msg;
+    size_t done = 0, frame = 0, n;  // frame: このwriteで受信中のフレームが始まった位置
+    int ret;
+
+    // 前のwriteで捨てたフレームのエラーを返す
+    if (st->err != 0) {
+        ret = st->err;
+        st->err = 0;
+        return ret;
+    }
+
+    while (done < count || (st->hdr_len == sizeof(st->hdr) && st->hdr.len == 0)) {
+        // 捨てたフレームの本体が残っていれば読み捨てる
+        if (st->skip > 0) {
+            done += stack_stream_skip(st, from, count - done);
+            continue;
+        }
+
+        // ヘッダを受信する
+        if (st->hdr_len < sizeof(st->hdr)) {
+            if (st->hdr_len == 0) {
+                frame = done;
+            }
+            n = min(sizeof(st->hdr) - st->hdr_len, count - done);
+            if (copy_from_iter((char *)&st->hdr + st->hdr_len, n, from) != n) {
+                return done ? done : -EFAULT;
+            }
+            st->hdr_len += n;
+            done += n;
+            if (st->hdr_len < sizeof(st->hdr)) {
+                break;
+            }
+            // 大きすぎるメッセージは本体を読み捨てる
+            if (st->hdr.len > READ_ONCE(max_msg_size)) {
+                st->hdr_len = 0;
+                st->skip = st->hdr.len;
+                return stack_stream_reject(st, from, count, done, frame, -EMSGSIZE);
+            }
+        }
+
+        // スロットを予約してメッセージを確保する
+        // 満杯で待てないときは次のwriteで再度予約を試みる
+        if (st->msg == NULL) {
+            msg = stack_msg_new_wait(sd, nonblock);
+            if (IS_ERR(msg)) {
+                return done ? done : PTR_ERR(msg);
+            }
+            st->msg = msg;
+        }
+        msg = st->msg;
+        msg->prio = st->hdr.prio;
+
+        // メッセージ本体を受信する
+        n = min(st->hdr.len - msg->len, count - done);
+        ret = stack_msg_copy_from_iter(msg, msg->len, from, n);
+        if (ret != 0) {
+            return done ? done : ret;
+        }
+        msg->len += n;
+        done += n;
+        if (msg->len < st->hdr.len) {
+            break;
+        }
+
+        // メッセージが揃ったのでpushする
+        // 満杯で待てなかったときやシグナルで起こされたときは、メッセージを持ち越して
+        // 次のwriteで再度pushする。それ以外の失敗ではやり直しても積めないので捨てる
+        ret = stack_push_wait(sd, msg, nonblock);
+        if (ret != 0) {
+            if (ret == -EAGAIN || ret == -ERESTARTSYS) {
+                return done ? done : ret;
+            }
+            stack_msg_discard(sd, msg);
+            st->msg = NULL;
+            st->hdr_len = 0;
+            return stack_stream_reject(st, from, count, done, frame, ret);
+        }
+        st->msg = NULL;
+        st->hdr_len = 0;
+    }
+
+    return done;
+}
+
+// ストリームモードのwriteハンドラ
+static ssize_t stack_stream_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct stack_stream *st = iocb->ki_filp->private_data;
+    struct stack_dev *sd = stack_dev_of(iocb->ki_filp);
+    size_t count = iov_iter_count(from);
+    u64 start = ktime_get_ns();
+    ssize_t ret;
+
+    ret = stack_stream_write(sd, st, from, stack_nonblock(iocb));
+    trace_stack_write(sd->id, count, 0, ret);
+    stack_stat_op(sd, STACK_OP_WRITE, start, ret);
+    return ret;
+}
+
+// バッファに収まるだけメッセージをpopして「ヘッダ + メッセージ」の並びで返す
+// 1つ目のメッセージがバッファに収まらないときは分割して送り、残りは次のreadで返す
+// 空のときは1つ目のメッセージがpushされるまで待つ
+static ssize_t stack_stream_read(struct stack_dev *sd, struct stack_stream *st, struct iov_iter *to, bool nonblock)
+{
+    size_t count = iov_iter_count(to);
+    struct stack_frame hdr = { 0 };
+    struct stack_msg *msg;
+    size_t done = 0, n;
+    int ret;
+
+    while (done < count) {
+        // 送信中のメッセージがなければ次をpopする
+        // 2つ目以降は分割せずに収まるものだけ取り出す
+        if (st->rmsg == NULL) {
+            if (done == 0) {
+                msg = stack_pop_wait(sd, SIZE_MAX, nonblock);
+                if (IS_ERR(msg)) {
+                    return PTR_ERR(msg);
+                }
+            } else {
+                if (count - done < sizeof(hdr)) {
+                    break;
+                }
+                msg = stack_pop(sd, count - done - sizeof(hdr));
+                if (IS_ERR_OR_NULL(msg)) {
+                    break;
+                }
+            }
+            st->rmsg = msg;
+            st->roff = 0;
+        }
+        msg = st->rmsg;
+
+        // ヘッダを送信する
+        if (st->roff < sizeof(hdr)) {
+            hdr.len = msg->len;
+            hdr.prio = msg->prio;
+            n = min(sizeof(hdr) - st->roff, count - done);
+            if (copy_to_iter((char *)&hdr + st->roff, n, to) != n) {
+                return done ? done : -EFAULT;
+            }
+            st->roff += n;
+            done += n;
+            if (st->roff < sizeof(hdr)) {
+                break;
+            }
+        }
+
+        // メッセージ本体を送信する
+        n = min(msg->len - (st->roff - sizeof(hdr)), count - done);
+        ret = stack_msg_copy_to_iter(msg, st->roff - sizeof(hdr), to, n);
+        if (ret != 0) {
+            return done ? done : ret;
+        }
+        st->roff += n;
+        done += n;
+        if (st->roff - sizeof(hdr) < msg->len) {
+            break;
+        }
+        stack_msg_put(msg);
+        st->rmsg = NULL;
+    }
+
+    return done;
+}
+
+// ストリームモードのreadハンドラ
+static ssize_t stack_stream_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct stack_stream *st = iocb->ki_filp->private_data;
+    struct stack_dev *sd = stack_dev_of(iocb->ki_filp);
+    size_t count = iov_iter_count(to);
+    u64 start = ktime_get_ns();
+    ssize_t ret;
+
+    ret = stack_stream_read(sd, st, to, stack_nonblock(iocb));
+    trace_stack_read(sd->id, count, 0, ret);
+    stack_stat_op(sd, STACK_OP_READ, start, ret);
+    return ret;
+}
+
+// STACK_IOC_PUSH: iovの各バッファをメッセージとしてまとめてpushする
+// 1つ目のメッセージだけは空きができるまで待つ
+static int stack_ioctl_push(struct stack_dev *sd, struct stack_iov __user *uiov, unsigned int count, unsigned int *done, bool nonblock)
+{
+    struct stack_iov iov;
+    struct stack_msg *msg;
+    struct iovec iovec;
+    struct iov_iter from;
+    int ret;
+
+    for (*done = 0; *done < count; (*done)++) {
+        if (copy_from_user(&iov, &uiov[*done], sizeof(iov))) {
+            return -EFAULT;
+        }
+        ret = import_single_range(WRITE, u64_to_user_ptr(iov.buf), iov.len, &iovec, &from);
+        if (ret != 0) {
+            return ret;
+        }
+        if (iov.len > READ_ONCE(max_msg_size)) {
+            return -EMSGSIZE;
+        }
+        msg = stack_msg_new_wait(sd, nonblock || *done > 0);
+        if (IS_ERR(msg)) {
+            return PTR_ERR(msg);
+        }
+        ret = stack_msg_copy_from_iter(msg, 0, &from, iov.len);
+        if (ret != 0) {
+            stack_msg_discard(sd, msg);
+            return ret;
+        }
+        msg->len = iov.len;
+        msg->prio = iov.prio;
+        ret = stack_push_wait(sd, msg, nonblock || *done > 0);
+        if (ret != 0) {
+            stack_msg_discard(sd, msg);
+            return ret;
+        }
+    }
+    return 0;
+}
+
+// popする前に、コピー先のユーザ空間のバッファにlenバイト書き込めることを確かめる
+// popした後にコピーで失敗するとメッセージが失われるので、先にページを用意しておく
+// (中身は書き換えない)。メッセージはMSG_SIZE_LIMITより大きくならないのでそこまで確かめる
+static int stack_user_writable(void __user *buf, size_t len)
+{
+    len = min_t(size_t, len, MSG_SIZE_LIMIT);
+    return fault_in_safe_writeable(buf, len) == 0 ? 0 : -EFAULT;
+}
+
+// メッセージをiovのバッファにコピーし、メッセージ長と優先度をuiovに書き戻す
+static int stack_ioctl_copy_msg(struct stack_iov __user *uiov, struct stack_iov *iov, struct stack_msg *msg)
+{
+    struct iovec iovec;
+    struct iov_iter to;
+    int ret;
+
+    iov->len = msg->len;
+    iov->prio = msg->prio;
+    ret = import_single_range(READ, u64_to_user_ptr(iov->buf), iov->len, &iovec, &to);
+    if (ret == 0) {
+        ret = stack_msg_copy_to_iter(msg, 0, &to, msg->len);
+    }
+    if (ret == 0 && copy_to_user(uiov, iov, sizeof(*iov))) {
+        ret = -EFAULT;
+    }
+    return ret;
+}
+
+// STACK_IOC_POP: メッセージをiovの各バッファに取り出す
+// iov.lenには実際のメッセージ長を書き戻す
+// 1つ目のメッセージだけpushされるまで待つ
+// 書き込めないバッファのときはpopせずに-EFAULTを返す
+static int stack_ioctl_pop(struct stack_dev *sd, struct stack_iov __user *uiov, unsigned int count, unsigned int *done,
+                           bool nonblock)
+{
+    struct stack_iov iov;
+    struct stack_msg *msg;
+    int ret = 0;
+
+    for (*done = 0; *done < count; (*done)++) {
+        if (copy_from_user(&iov, &uiov[*done], sizeof(iov))) {
+            return -EFAULT;
+        }
+        ret = stack_user_writable(&uiov[*done], sizeof(iov));
+        if (ret == 0) {
+            ret = stack_user_writable(u64_to_user_ptr(iov.buf), iov.len);
+        }
+        if (ret != 0) {
+            return ret;
+        }
+        msg = stack_pop_wait(sd, iov.len, nonblock || *done > 0);
+        if (IS_ERR_OR_NULL(msg)) {
+            return msg ? PTR_ERR(msg) : -ENODATA;
+        }
+        ret = stack_ioctl_copy_msg(&uiov[*done], &iov, msg);
+        stack_msg_put(msg);
+        if (ret != 0) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+// STACK_IOC_PEEK: 先頭からcount個のメッセージを取り出さずにiovの各バッファにコピーする
+// 参照は呼び出しごとに1回だけまとめて取り、ユーザ空間へのコピーはロックを手放してから行う
+// 参照を取った後にpushされたメッセージは含まない
+static int stack_ioctl_peek(struct stack_dev *sd, struct stack_iov __user *uiov, unsigned int count, unsigned int *done)
+{
+    struct stack_msg **msgs;
+    unsigned int *cand = NULL;
+    struct stack_iov iov;
+    unsigned int n, i;
+    int ret = 0;
+
+    *done = 0;
+    count = min(count, stack_depth(sd));
+    if (count == 0) {
+        return -ENODATA;
+    }
+    msgs = kvmalloc_array(count, sizeof(*msgs), GFP_KERNEL);
+    if (msgs == NULL) {
+        return -ENOMEM;
+    }
+    if (sd->ring == NULL && sd->discipline == STACK_PRIO) {
+        cand = kvmalloc_array(count + 1, sizeof(*cand), GFP_KERNEL);
+        if (cand == NULL) {
+            kvfree(msgs);
+            return -ENOMEM;
+        }
+    }
+    n = stack_peek(sd, msgs, count, cand);
+    for (i = 0; i < n && ret == 0; i++) {
+        if (copy_from_user(&iov, &uiov[i], sizeof(iov))) {
+            ret = -EFAULT;
+        } else if (msgs[i]->len > iov.len) {
+            ret = -EMSGSIZE;
+        } else {
+            ret = stack_ioctl_copy_msg(&uiov[i], &iov, msgs[i]);
+        }
+        if (ret == 0) {
+            (*done)++;
+        }
+    }
+    if (ret == 0 && n == 0) {
+        ret = -ENODATA;
+    }
+    for (i = 0; i < n; i++) {
+        stack_msg_put(msgs[i]);
+    }
+    kvfree(cand);
+    kvfree(msgs);
+    return ret;
+}
+
+// ioctlのコマンドを処理する
+// バッチでのpush/pop/peekと、積まれているメッセージ数の取得を行う
+static long stack_ioctl_cmd(struct stack_dev *sd, struct file *file, unsigned int cmd, unsigned long arg)
+{
+    void __user *argp = (void __user *)arg;
+    struct stack_batch batch;
+    struct stack_depth depth = { 0 };
+    unsigned int cand[2];   // 1個だけpeekするときのstack_peekの作業領域
+    struct stack_msg *msg;
+    int ret;
+
+    switch (cmd) {
+    case STACK_IOC_PUSH:
+    case STACK_IOC_POP:
+    case STACK_IOC_PEEK:
+        if (copy_from_user(&batch, argp, sizeof(batch))) {
+            return -EFAULT;
+        }
+        if (cmd == STACK_IOC_PUSH) {
+            ret = stack_ioctl_push(sd, u64_to_user_ptr(batch.iov), batch.count, &batch.done,
+                                   file->f_flags & O_NONBLOCK);
+        } else if (cmd == STACK_IOC_POP) {
+            ret = stack_ioctl_pop(sd, u64_to_user_ptr(batch.iov), batch.count, &batch.done,
+                                  file->f_flags & O_NONBLOCK);
+        } else {
+            ret = stack_ioctl_peek(sd, u64_to_user_ptr(batch.iov), batch.count, &batch.done);
+        }
+        // 1つでも処理できていれば成功として処理できた数を返す
+        if (batch.done > 0) {
+            ret = 0;
+        }
+        if (copy_to_user(argp, &batch, sizeof(batch))) {
+            return -EFAULT;
+        }
+        return ret;
+    case STACK_IOC_DEPTH:
+        depth.depth = stack_depth(sd);
+        if (stack_peek(sd, &msg, 1, cand) > 0) {
+            depth.top_len = msg->len;
+            stack_msg_put(msg);
+        }
+        return copy_to_user(argp, &depth, sizeof(depth)) ? -EFAULT : 0;
+    case STACK_IOC_RING_WAIT:
+        return stack_ring_wait(sd, arg);
+    case STACK_IOC_RING_WAKE:
+        wake_up_interruptible(&sd->read_wq);
+        wake_up_interruptible(&sd->write_wq);
+        return 0;
+    case STACK_IOC_SET_PRIO:
+        // 通常モードで書き込み中のメッセージにだけ設定できる
+        if (file->f_op != &stack_fops || !(file->f_mode & FMODE_WRITE)) {
+            return -EINVAL;
+        }
+        msg = file->private_data;
+        msg->prio = arg;
+        return 0;
+    default:
+        return -ENOTTY;
+    }
+}
+
+// ioctlハンドラ
+static long stack_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+    struct stack_dev *sd = stack_dev_of(file);
+    u64 start = ktime_get_ns();
+    long ret;
+
+    ret = stack_ioctl_cmd(sd, file, cmd, arg);
+    stack_stat_op(sd, STACK_OP_IOCTL, start, ret);
+    return ret;
+}
+
+// pollハンドラ
+// popできるときはEPOLLIN、pushできるときはEPOLLOUTを返す
+// リングモードでのユーザ空間からのpush/popはSTACK_IOC_RING_WAKEを呼ぶまで通知されない
+static __poll_t stack_poll(struct file *file, poll_table *wait)
+{
+    struct stack_dev *sd = stack_dev_of(file);
+    __poll_t mask = 0;
+
+    poll_wait(file, &sd->read_wq, wait);
+    poll_wait(file, &sd->write_wq, wait);
+    if (stack_dead(sd)) {
+        mask |= EPOLLERR | EPOLLHUP;
+    }
+    if (stack_readable(sd)) {
+        mask |= EPOLLIN | EPOLLRDNORM;
+    }
+    if (stack_writable(sd)) {
+        mask |= EPOLLOUT | EPOLLWRNORM;
+    }
+    return mask;
+}
+
+// STACK_URING_POP: メッセージを1つbufにpopしてメッセージ長を返す
+// 空のときはpushされるまで寝る(nonblockのときは-EAGAINを返す)
+static int stack_uring_pop(struct stack_dev *sd, u64 buf, u32 len, bool nonblock)
+{
+    struct stack_msg *msg;
+    struct iovec iovec;
+    struct iov_iter to;
+    int ret;
+
+    // 書き込めないバッファのときはpopせずに-EFAULTを返す
+    ret = stack_user_writable(u64_to_user_ptr(buf), len);
+    if (ret != 0) {
+        return ret;
+    }
+    msg = stack_pop_wait(sd, len, nonblock);
+    if (IS_ERR(msg)) {
+        return PTR_ERR(msg);
+    }
+    ret = import_single_range(READ, u64_to_user_ptr(buf), msg->len, &iovec, &to);
+    if (ret == 0) {
+        ret = stack_msg_copy_to_iter(msg, 0, &to, msg->len);
+    }
+    if (ret == 0) {
+        ret = msg->len;
+    }
+    stack_msg_put(msg);
+    return ret;
+}
+
+// STACK_URING_PUSH: bufのlenバイトをメッセージとしてpushする
+static int stack_uring_push(struct stack_dev *sd, u64 buf, u32 len, u32 prio, bool nonblock)
+{
+    struct stack_msg *msg;
+    struct iovec iovec;
+    struct iov_iter from;
+    int ret;
+
+    ret = import_single_range(WRITE, u64_to_user_ptr(buf), len, &iovec, &from);
+    if (ret != 0) {
+        return ret;
+    }
+    if (len > READ_ONCE(max_msg_size)) {
+        return -EMSGSIZE;
+    }
+    msg = stack_msg_new_wait(sd, nonblock);
+    if (IS_ERR(msg)) {
+        return PTR_ERR(msg);
+    }
+    ret = stack_msg_copy_from_iter(msg, 0, &from, len);
+    if (ret == 0) {
+        msg->len = len;
+        msg->prio = prio;
+        ret = stack_push_wait(sd, msg, nonblock);
+    }
+    if (ret != 0) {
+        stack_msg_discard(sd, msg);
+        return ret;
+    }
+    return len;
+}
+
+// io_uringのIORING_OP_URING_CMDでpush/popとバッチ処理を受け付ける
+// 待つ必要があるときは-EAGAINを返し、io_uringのワーカーから待てる状態で再発行させる
+// ワーカーでの待ちはioctlと同じwait_event_interruptibleなので、リングの終了時に取り消せる
+static int stack_uring_issue(struct stack_dev *sd, struct io_uring_cmd *ioucmd, unsigned int issue_flags)
+{
+    const struct stack_uring_cmd *cmd = ioucmd->cmd;
+    bool nonblock = issue_flags & IO_URING_F_NONBLOCK;
+    u64 buf = READ_ONCE(cmd->buf);
+    u32 len = READ_ONCE(cmd->len);
+    unsigned int done = 0;
+    int ret;
+
+    switch (ioucmd->cmd_op) {
+    case STACK_URING_PUSH:
+        return stack_uring_push(sd, buf, len, READ_ONCE(cmd->prio), nonblock);
+    case STACK_URING_POP:
+        return stack_uring_pop(sd, buf, len, nonblock);
+    case STACK_URING_PUSH_BATCH:
+        ret = stack_ioctl_push(sd, u64_to_user_ptr(buf), len, &done, nonblock);
+        return done > 0 ? done : ret;
+    case STACK_URING_POP_BATCH:
+        ret = stack_ioctl_pop(sd, u64_to_user_ptr(buf), len, &done, nonblock);
+        return done > 0 ? done : ret;
+    default:
+        return -ENOTTY;
+    }
+}
+
+// uring_cmdハンドラ
+static int stack_uring_cmd(struct io_uring_cmd *ioucmd, unsigned int issue_flags)
+{
+    struct stack_dev *sd = stack_dev_of(ioucmd->file);
+    u64 start = ktime_get_ns();
+    int ret;
+
+    ret = stack_uring_issue(sd, ioucmd, issue_flags);
+    stack_stat_op(sd, STACK_OP_URING_CMD, start, ret);
+    return ret;
+}
+
+// ファイル操作構造体
+static const struct file_operations stack_fops = {
+    .owner          = THIS_MODULE,
+    .open           = stack_open,
+    .release        = stack_release,
+    .read_iter      = stack_read_iter,
+    .write_iter     = stack_write_iter,
+    .splice_read    = generic_file_splice_read,
+    .splice_write   = iter_file_splice_write,
+    .unlocked_ioctl = stack_ioctl,
+    .compat_ioctl   = compat_ptr_ioctl,
+    .mmap           = stack_mmap,
+    .poll           = stack_poll,
+    .uring_cmd      = stack_uring_cmd,
+};
+
+// ストリームモードのファイル操作構造体
+static const struct file_operations stack_stream_fops = {
+    .owner          = THIS_MODULE,
+    .open           = stack_stream_open,
+    .release        = stack_stream_release,
+    .read_iter      = stack_stream_read_iter,
+    .write_iter     = stack_stream_write_iter,
+    .splice_read    = generic_file_splice_read,
+    .splice_write   = iter_file_splice_write,
+    .unlocked_ioctl = stack_ioctl,
+    .compat_ioctl   = compat_ptr_ioctl,
+    .mmap           = stack_mmap,
+    .poll           = stack_poll,
+    .uring_cmd      = stack_uring_cmd,
+};
+
+// debugfsのsnapshotファイルを開いたときの状態
+// 読み込みでは開いた時点のメッセージに参照を取っておき、pushされた順に書き出す
+// 書き込みではストリームモードと同じ形式のフレームを受け取ってpushし直す
+struct stack_snapshot {
+    struct stack_dev *sd;
+    struct stack_snapshot_header hdr;
+    size_t off;                 // 送受信済みのヘッダのバイト数
+    struct stack_msg **msgs;    // 書き出すメッセージ(参照を取ってある)
+    size_t count;               // msgsの要素数
+    size_t idx;                 // 書き出し中のメッセージ
+    size_t roff;                // 書き出し中のメッセージの送信済みバイト数(フレームヘッダ込み)
+    struct stack_stream st;     // 書き込み中のフレーム
+};
+
+static struct dentry *stack_debugfs;    // debugfsのstackディレクトリ
+
+// pushされた順に並べるための比較関数
+static int stack_msg_cmp_seq(const void *a, const void *b)
+{
+    const struct stack_msg *ma = *(struct stack_msg * const *)a;
+    const struct stack_msg *mb = *(struct stack_msg * const *)b;
+
+    return ma->seq < mb->seq ? -1 : ma->seq > mb->seq;
+}
+
+// スナップショットで参照を取ったメッセージを手放す
+static void stack_snapshot_put(struct stack_snapshot *snap)
+{
+    size_t i;
+
+    for (i = 0; i < snap->count; i++) {
+        stack_msg_put(snap->msgs[i]);
+    }
+    kvfree(snap->msgs);
+    snap->msgs = NULL;
+    snap->count = 0;
+}
+
+// 積まれているメッセージに参照を取ってpushされた順に並べる
+// メッセージのデータはコピーしないので、数十万メッセージでも一瞬で終わる
+// ロックはシャードごとに取るので、シャード間では同時刻のスナップショットにはならない
+static int stack_snapshot_take(struct stack_dev *sd, struct stack_snapshot *snap)
+{
+    struct stack_shard *sh;
+    struct stack_msg *msg;
+    size_t size, start, j;
+    unsigned int i;
+
+    // 数えている間にpushされても足りるよう少し余分に確保する
+    // リングはユーザ空間が書き換えられるsd->ring->slotsではなくring_slotsで大きさを決める
+    size = sd->ring != NULL ? ring_slots : stack_depth(sd) + 64;
+retry:
+    snap->msgs = kvmalloc_array(size, sizeof(*snap->msgs), GFP_KERNEL);
+    if (snap->msgs == NULL) {
+        return -ENOMEM;
+    }
+    snap->count = 0;
+
+    if (sd->ring != NULL) {     // リングは取り出さずにコピーする
+        while (snap->count < size && (msg = stack_ring_peek(sd, snap->count)) != NULL) {
+            snap->msgs[snap->count++] = msg;
+        }
+        return 0;
+    }
+    for (i = 0; i < sd->nr_shards; i++) {
+        sh = &sd->shards[i];
+        spin_lock(&sh->lock);
+        if (sh->depth > size - snap->count) {  // 足りなければ大きくしてやり直す
+            spin_unlock(&sh->lock);
+            stack_snapshot_put(snap);
+            size *= 2;
+            goto retry;
+        }
+        start = snap->count;
+        switch (sd->discipline) {
+        case STACK_LIFO:
+            list_for_each_entry_reverse(msg, &sh->list, list) {
+                snap->msgs[snap->count++] = msg;
+            }
+            break;
+        case STACK_FIFO:
+            list_for_each_entry(msg, &sh->list, list) {
+                snap->msgs[snap->count++] = msg;
+            }
+            break;
+        case STACK_PRIO:
+            memcpy(&snap->msgs[start], sh->heap, sh->depth * sizeof(*sh->heap));
+            snap->count += sh->depth;
+            break;
+        }
+        for (j = start; j < snap->count; j++) {
+            refcount_inc(&snap->msgs[j]->ref);
+        }
+        spin_unlock(&sh->lock);
+        if (sd->discipline == STACK_PRIO) {
+            sort(&snap->msgs[start], snap->count - start, sizeof(*snap->msgs), stack_msg_cmp_seq, NULL);
+        }
+    }
+    return 0;
+}
+
+// snapshotファイルのopenハンドラ
+// 読み込み(書き出し)か書き込み(復元)のどちらか一方だけで開ける
+static int stack_snapshot_open(struct inode *inode, struct file *file)
+{
+    struct stack_dev *sd = inode->i_private;
+    struct stack_snapshot *snap;
+    int ret;
+
+    if ((file->f_mode & FMODE_READ) && (file->f_mode & FMODE_WRITE)) {
+        return -EINVAL;
+    }
+    snap = kzalloc(sizeof(*snap), GFP_KERNEL_ACCOUNT);
+    if (snap == NULL) {
+        return -ENOMEM;
+    }
+    snap->sd = sd;
+    if (file->f_mode & FMODE_READ) {
+        ret = stack_snapshot_take(sd, snap);
+        if (ret != 0) {
+            kfree(snap);
+            return ret;
+        }
+        snap->hdr.magic = STACK_SNAPSHOT_MAGIC;
+        snap->hdr.version = STACK_SNAPSHOT_VERSION;
+        snap->hdr.count = snap->count;
+    }
+    stack_dev_get(sd);  // debugfsのファイルが削除されてもreleaseまでインスタンスを解放させない
+    file->private_data = snap;
+    return nonseekable_open(inode, file);
+}
+
+// snapshotファイルのreleaseハンドラ
+static int stack_snapshot_release(struct inode *inode, struct file *file)
+{
+    struct stack_snapshot *snap = file->private_data;
+
+    stack_snapshot_put(snap);
+    // 復元途中のメッセージは捨てる
+    if (snap->st.msg != NULL) {
+        stack_msg_discard(snap->sd, snap->st.msg);
+    }
+    stack_dev_put(snap->sd);
+    kfree(snap);
+    return 0;
+}
+
+// snapshotファイルのreadハンドラ
+// 「ヘッダ + (フレームヘッダ + メッセージ) * count」を順に返す
+static ssize_t stack_snapshot_read(struct file *file, char __user *buf, size_t count, loff_t *ppos)
+{
+    struct stack_snapshot *snap = file->private_data;
+    struct stack_frame frame;
+    struct stack_msg *msg;
+    struct iovec iov;
+    struct iov_iter to;
+    size_t done = 0, n;
+    int ret;
+
+    ret = import_single_range(READ, buf, count, &iov, &to);
+    if (ret != 0) {
+        return ret;
+    }
+    // スナップショットのヘッダを送信する
+    if (snap->off < sizeof(snap->hdr)) {
+        n = min(sizeof(snap->hdr) - snap->off, count);
+        if (copy_to_iter((char *)&snap->hdr + snap->off, n, &to) != n) {
+            return -EFAULT;
+        }
+        snap->off += n;
+        done += n;
+    }
+    while (done < count && snap->idx < snap->count) {
+        msg = snap->msgs[snap->idx];
+        // フレームヘッダを送信する
+        if (snap->roff < sizeof(frame)) {
+            frame.len = msg->len;
+            frame.prio = msg->prio;
+            n = min(sizeof(frame) - snap->roff, count - done);
+            if (copy_to_iter((char *)&frame + snap->roff, n, &to) != n) {
+                return done ? done : -EFAULT;
+            }
+            snap->roff += n;
+            done += n;
+        }
+        // メッセージ本体を送信する
+        n = min(msg->len - (snap->roff - sizeof(frame)), count - done);
+        ret = stack_msg_copy_to_iter(msg, snap->roff - sizeof(frame), &to, n);
+        if (ret != 0) {
+            return done ? done : ret;
+        }
+        snap->roff += n;
+        done += n;
+        if (snap->roff == sizeof(frame) + msg->len) {
+            snap->idx++;
+            snap->roff = 0;
+        }
+    }
+    *ppos += done;
+    return done;
+}
+
+// snapshotファイルのwriteハンドラ
+// readで得たデータを書き込むと、同じ順番でpushし直す
+// 容量やmax_msg_sizeが足りないときは途中で失敗するので、先に大きくしておくこと
+static ssize_t stack_snapshot_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
+{
+    struct stack_snapshot *snap = file->private_data;
+    struct iovec iov;
+    struct iov_iter from;
+    size_t done = 0, n;
+    ssize_t ret;
+
+    ret = import_single_range(WRITE, (char __user *)buf, count, &iov, &from);
+    if (ret != 0) {
+        return ret;
+    }
+    // スナップショットのヘッダを受信する
+    if (snap->off < sizeof(snap->hdr)) {
+        n = min(sizeof(snap->hdr) - snap->off, count);
+        if (copy_from_iter((char *)&snap->hdr + snap->off, n, &from) != n) {
+            return -EFAULT;
+        }
+        snap->off += n;
+        done += n;
+        if (snap->off < sizeof(snap->hdr)) {
+            *ppos += done;
+            return done;
+        }
+        if (snap->hdr.magic != STACK_SNAPSHOT_MAGIC || snap->hdr.version != STACK_SNAPSHOT_VERSION) {
+            snap->off = 0;
+            return -EINVAL;
+        }
+    }
+    // 残りはストリームモードと同じ形式
+    n = iov_iter_count(&from);
+    ret = stack_stream_write(snap->sd, &snap->st, &from, file->f_flags & O_NONBLOCK);
+    if (ret < 0) {
+        if (done == 0) {
+            return ret;
+        }
+        // ヘッダの分は受け付けたので、捨てたフレームがあればそのエラーは次のwriteで返す
+        if (iov_iter_count(&from) < n) {
+            snap->st.err = ret;
+        }
+        ret = n - iov_iter_count(&from);
+    }
+    done += ret;
+    *ppos += done;
+    return done;
+}
+
+// snapshotファイルのファイル操作構造体
+static const struct file_operations stack_snapshot_fops = {
+    .owner          = THIS_MODULE,
+    .open           = stack_snapshot_open,
+    .release        = stack_snapshot_release,
+    .read           = stack_snapshot_read,
+    .write          = stack_snapshot_write,
+    .llseek         = no_llseek,
+};
+
+// statsファイルのshow関数
+// 全CPU分を読み出したときに合計する
+static int stack_stats_show(struct seq_file *m, void *v)
+{
+    struct stack_dev *sd = m->private;
+    struct op_stats *sum;
+    u64 depth_hwm = 0;
+    int cpu;
+
+    sum = kzalloc(sizeof(*sum), GFP_KERNEL);
+    if (sum == NULL) {
+        return -ENOMEM;
+    }
+    op_stats_sum(sum, &sd->ops->st, STACK_NR_OPS);
+    for_each_possible_cpu(cpu) {
+        depth_hwm = max(depth_hwm, READ_ONCE(per_cpu_ptr(sd->ops, cpu)->depth_hwm));
+    }
+    op_stats_print(m, sum, stack_op_names, STACK_NR_OPS);
+    seq_printf(m, "depth_hwm %llu\n", depth_hwm);
+
+    kfree(sum);
+    return 0;
+}
+
+// statsファイルのwrite関数
+// "0"を書き込むと全CPUの統計(depth_hwmも含む)を0に戻す
+// 同時に行われている操作とは同期しない近似的なもの(op_stats_resetを参照)
+static ssize_t stack_stats_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
+{
+    struct stack_dev *sd = ((struct seq_file *)file->private_data)->private;
+
+    return op_stats_write(buf, count, sd->ops, sizeof(struct stack_op_stats));
+}
+
+static int stack_stats_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, stack_stats_show, inode->i_private);
+}
+
+// debugfsのstatsファイルの操作構造体
+static const struct file_operations stack_stats_fops = {
+    .owner          = THIS_MODULE,
+    .open           = stack_stats_open,
+    .read           = seq_read,
+    .write          = stack_stats_write,
+    .llseek         = seq_lseek,
+    .release        = single_release,
+};
+
+// 確保の統計を全CPU分合計する
+static struct stack_alloc_stat stack_alloc_stat_sum(void)
+{
+    struct stack_alloc_stat sum = { 0 };
+    struct stack_alloc_stat *st;
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        st = per_cpu_ptr(&alloc_stat, cpu);
+        sum.pool += READ_ONCE(st->pool);
+        sum.slab += READ_ONCE(st->slab);
+        sum.fail += READ_ONCE(st->fail);
+    }
+    return sum;
+}
+
+// alloc_poolファイルのshow関数
+static ssize_t stack_show_alloc_pool(struct class *class, struct class_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%lu\n", stack_alloc_stat_sum().pool);
+}
+
+// alloc_slabファイルのshow関数
+static ssize_t stack_show_alloc_slab(struct class *class, struct class_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%lu\n", stack_alloc_stat_sum().slab);
+}
+
+// alloc_failファイルのshow関数
+static ssize_t stack_show_alloc_fail(struct class *class, struct class_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%lu\n", stack_alloc_stat_sum().fail);
+}
+
+// pool_availファイルのshow関数
+static ssize_t stack_show_pool_avail(struct class *class, struct class_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%u\n", READ_ONCE(pool_avail));
+}
+
+static int stack_dev_create(struct device *parent, enum stack_discipline disc);
+
+// addファイルのstore関数
+// インスタンスを1つ追加する。キューの取り出し順(lifo, fifo, prio)を書き込むと
+// その順で、空行を書き込むとdisciplineモジュールパラメータの順で作る
+static ssize_t stack_store_add(struct class *class, struct class_attribute *attr, const char *buf, size_t count)
+{
+    int disc = stack_default_discipline;
+    int ret;
+
+    if (!sysfs_streq(buf, "")) {
+        disc = sysfs_match_string(stack_discipline_names, buf);
+        if (disc < 0) {
+            return disc;
+        }
+    }
+    ret = stack_dev_create(NULL, disc);
+    if (ret != 0) {
+        return ret;
+    }
+    return count;
+}
+
+static struct class_attribute class_attr_alloc_pool = __ATTR(alloc_pool, 0444, stack_show_alloc_pool, NULL);
+static struct class_attribute class_attr_alloc_slab = __ATTR(alloc_slab, 0444, stack_show_alloc_slab, NULL);
+static struct class_attribute class_attr_alloc_fail = __ATTR(alloc_fail, 0444, stack_show_alloc_fail, NULL);
+static struct class_attribute class_attr_pool_avail = __ATTR(pool_avail, 0444, stack_show_pool_avail, NULL);
+static struct class_attribute class_attr_add = __ATTR(add, 0200, NULL, stack_store_add);
+
+// クラス属性構造体配列(全インスタンスで共有するメッセージプールの統計)
+static struct attribute *stack_class_attrs[] = {
+    &class_attr_alloc_pool.attr,
+    &class_attr_alloc_slab.attr,
+    &class_attr_alloc_fail.attr,
+    &class_attr_pool_avail.attr,
+    &class_attr_add.attr,
+    NULL,
+};
+ATTRIBUTE_GROUPS(stack_class);
+
+// インスタンスの統計を全CPU分合計する
+static struct stack_dev_stat stack_dev_stat_sum(struct stack_dev *sd)
+{
+    struct stack_dev_stat sum = { 0 };
+    struct stack_dev_stat *st;
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        st = per_cpu_ptr(sd->stat, cpu);
+        sum.pushed += READ_ONCE(st->pushed);
+        sum.popped += READ_ONCE(st->popped);
+        sum.dropped += READ_ONCE(st->dropped);
+    }
+    return sum;
+}
+
+// depthファイルのshow関数
+static ssize_t stack_show_depth(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct stack_dev *sd = dev_get_drvdata(dev);
+
+    return sprintf(buf, "%u\n", stack_depth(sd));
+}
+
+// capacityファイルのshow関数
+// リングのスロット数はmmapしたユーザ空間が書き換えられるsd->ring->slotsではなくring_slotsから返す
+static ssize_t stack_show_capacity(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct stack_dev *sd = dev_get_drvdata(dev);
+
+    return sprintf(buf, "%u\n", sd->ring != NULL ? ring_slots : READ_ONCE(sd->capacity));
+}
+
+// capacityファイルのstore関数
+// 積まれているメッセージを保ったまま容量を変更する
+static ssize_t stack_store_capacity(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+    struct stack_dev *sd = dev_get_drvdata(dev);
+    unsigned int cap;
+    int ret;
+
+    ret = kstrtouint(buf, 0, &cap);
+    if (ret != 0) {
+        return ret;
+    }
+    ret = stack_dev_resize(sd, cap);
+    if (ret != 0) {
+        return ret;
+    }
+    return count;
+}
+
+// pushedファイルのshow関数
+static ssize_t stack_show_pushed(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct stack_dev *sd = dev_get_drvdata(dev);
+
+    return sprintf(buf, "%lu\n", stack_dev_stat_sum(sd).pushed);
+}
+
+// poppedファイルのshow関数
+static ssize_t stack_show_popped(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct stack_dev *sd = dev_get_drvdata(dev);
+
+    return sprintf(buf, "%lu\n", stack_dev_stat_sum(sd).popped);
+}
+
+// disciplineファイルのshow関数
+static ssize_t stack_show_discipline(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct stack_dev *sd = dev_get_drvdata(dev);
+
+    return sprintf(buf, "%s\n", stack_discipline_names[sd->ring != NULL ? STACK_FIFO : sd->discipline]);
+}
+
+// droppedファイルのshow関数
+static ssize_t stack_show_dropped(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct stack_dev *sd = dev_get_drvdata(dev);
+
+    return sprintf(buf, "%lu\n", stack_dev_stat_sum(sd).dropped);
+}
+
+// bytesファイルのshow関数
+static ssize_t stack_show_bytes(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct stack_dev *sd = dev_get_drvdata(dev);
+
+    return sprintf(buf, "%ld\n", atomic_long_read(&sd->bytes));
+}
+
+// max_bytesファイルのshow関数
+static ssize_t stack_show_max_bytes(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct stack_dev *sd = dev_get_drvdata(dev);
+
+    return sprintf(buf, "%lu\n", READ_ONCE(sd->max_bytes));
+}
+
+// max_bytesファイルのstore関数
+// 小さくしても積まれているメッセージは捨てず、下回るまでpushを止める
+static ssize_t stack_store_max_bytes(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+    struct stack_dev *sd = dev_get_drvdata(dev);
+    unsigned long val;
+    int ret;
+
+    ret = kstrtoul(buf, 0, &val);
+    if (ret != 0) {
+        return ret;
+    }
+    WRITE_ONCE(sd->max_bytes, val);
+    wake_up_interruptible(&sd->write_wq);  // 大きくしたときは待っているpushを起こす
+    return count;
+}
+
+// policyファイルのshow関数
+static ssize_t stack_show_policy(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct stack_dev *sd = dev_get_drvdata(dev);
+
+    return sprintf(buf, "%s\n", stack_policy_names[READ_ONCE(sd->policy)]);
+}
+
+// policyファイルのstore関数
+static ssize_t stack_store_policy(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+    struct stack_dev *sd = dev_get_drvdata(dev);
+    int ret;
+
+    ret = sysfs_match_string(stack_policy_names, buf);
+    if (ret < 0) {
+        return ret;
+    }
+    WRITE_ONCE(sd->policy, ret);
+    wake_up_interruptible(&sd->write_wq);  // 待っているpushに新しい方針で再試行させる
+    return count;
+}
+
+static DEVICE_ATTR(depth, 0444, stack_show_depth, NULL);
+static DEVICE_ATTR(capacity, 0644, stack_show_capacity, stack_store_capacity);
+static DEVICE_ATTR(pushed, 0444, stack_show_pushed, NULL);
+static DEVICE_ATTR(popped, 0444, stack_show_popped, NULL);
+static DEVICE_ATTR(discipline, 0444, stack_show_discipline, NULL);
+static DEVICE_ATTR(dropped, 0444, stack_show_dropped, NULL);
+static DEVICE_ATTR(bytes, 0444, stack_show_bytes, NULL);
+static DEVICE_ATTR(max_bytes, 0644, stack_show_max_bytes, stack_store_max_bytes);
+static DEVICE_ATTR(policy, 0644, stack_show_policy, stack_store_policy);
+
+// デバイス属性構造体配列(インスタンスごとの状態)
+static struct attribute *stack_attrs[] = {
+    &dev_attr_depth.attr,
+    &dev_attr_capacity.attr,
+    &dev_attr_pushed.attr,
+    &dev_attr_popped.attr,
+    &dev_attr_discipline.attr,
+    &dev_attr_dropped.attr,
+    &dev_attr_bytes.attr,
+    &dev_attr_max_bytes.attr,
+    &dev_attr_policy.attr,
+    NULL,
+};
+ATTRIBUTE_GROUPS(stack);
+
+// class構造体
+static struct class stack_class = {
+    .owner  = THIS_MODULE,
+    .name   = DEV_NAME,
+    .class_groups = stack_class_groups,
+    .dev_groups = stack_groups,
+};
+
+static bool stack_devs_closed = true;   // remove後はインスタンスを追加できない
+
+// インスタンスのメモリを解放する
+static void stack_dev_free(struct stack_dev *sd)
+{
+    unsigned int i;
+
+    vfree(sd->ring);
+    for (i = 0; sd->shards != NULL && i < sd->nr_shards; i++) {
+        kfree(sd->shards[i].heap);
+    }
+    kfree(sd->shards);
+    free_percpu(sd->ops);
+    free_percpu(sd->stat);
+    kfree(sd);
+}
+
+// 最後の参照を手放したときに呼ばれる
+// 削除後に開いていたファイルから積まれたメッセージも含めて、残っているメッセージをすべて削除する
+static void stack_dev_release(struct device *dev)
+{
+    struct stack_dev *sd = container_of(dev, struct stack_dev, dev);
+    struct stack_msg *msg;
+
+    while (!IS_ERR_OR_NULL(msg = stack_pop(sd, SIZE_MAX))) {
+        stack_msg_put(msg);
+    }
+    stack_dev_free(sd);
+}
+
+// インスタンスを1つ作成して/dev/stackNと/dev/stackN_streamを作る
+static int stack_dev_create(struct device *parent, enum stack_discipline disc)
+{
+    struct stack_dev *sd;
+    struct device *dev;
+    dev_t devt;
+    int ret;
+
+    mutex_lock(&stack_devs_lock);
+    if (stack_devs_closed) {
+        ret = -ENODEV;
+        goto out_unlock;
+    }
+    if (nr_stack_devs >= STACK_MAX_INSTANCES) {
+        ret = -ENOSPC;
+        goto out_unlock;
+    }
+
+    sd = kzalloc(sizeof(*sd), GFP_KERNEL);
+    if (sd == NULL) {
+        ret = -ENOMEM;
+        goto out_unlock;
+    }
+    sd->id = nr_stack_devs;
+    sd->capacity = READ_ONCE(capacity);
+    mutex_init(&sd->resize_lock);
+    sd->discipline = disc;
+    sd->max_bytes = READ_ONCE(max_bytes);
+    sd->policy = STACK_POLICY_BLOCK;
+    atomic_long_set(&sd->bytes, 0);
+    init_waitqueue_head(&sd->read_wq);
+    init_waitqueue_head(&sd->write_wq);
+    sd->stat = alloc_percpu(struct stack_dev_stat);
+    sd->ops = alloc_percpu(struct stack_op_stats);
+    if (sd->stat == NULL || sd->ops == NULL) {
+        ret = -ENOMEM;
+        goto out_free;
+    }
+    ret = stack_shards_init(sd);
+    if (ret != 0) {
+        goto out_free;
+    }
+    ret = stack_ring_init(sd);
+    if (ret != 0) {
+        goto out_free;
+    }
+
+    // /dev/stackNのデバイスとcdevを一緒に登録する
+    // 1つのcdevで通常モードとストリームモードの2つのマイナー番号を受け持つ
+    // ここから先で失敗したときはput_deviceでstack_dev_releaseから解放する
+    devt = MKDEV(MAJOR(stack_devt), MINOR(stack_devt) + sd->id * STACK_MINORS);
+    device_initialize(&sd->dev);
+    sd->dev.class = &stack_class;
+    sd->dev.parent = parent;
+    sd->dev.devt = devt;
+    sd->dev.release = stack_dev_release;
+    dev_set_drvdata(&sd->dev, sd);
+    ret = dev_set_name(&sd->dev, DEV_NAME "%u", sd->id);
+    if (ret != 0) {
+        goto out_put;
+    }
+    cdev_init(&sd->cdev, &stack_fops);
+    sd->cdev.owner = THIS_MODULE;
+    ret = cdev_device_add(&sd->cdev, &sd->dev);
+    if (ret != 0) {
+        goto out_put;
+    }
+    dev = device_create(&stack_class, parent, devt + STACK_MINOR_STREAM, sd, DEV_NAME "%u_stream", sd->id);
+    if (IS_ERR(dev)) {
+        ret = PTR_ERR(dev);
+        goto out_del;
+    }
+    sd->stream_dev = dev;
+
+    // debugfsにスナップショットの書き出し/復元用のファイルと統計のファイルを作る
+    sd->debugfs = debugfs_create_dir(dev_name(&sd->dev), stack_debugfs);
+    debugfs_create_file("snapshot", 0600, sd->debugfs, sd, &stack_snapshot_fops);
+    debugfs_create_file("stats", 0600, sd->debugfs, sd, &stack_stats_fops);
+
+    rcu_assign_pointer(stack_devs[nr_stack_devs++], sd);
+    mutex_unlock(&stack_devs_lock);
+    return 0;
+
+out_del:
+    cdev_device_del(&sd->cdev, &sd->dev);
+out_put:
+    put_device(&sd->dev);
+    goto out_unlock;
+out_free:
+    stack_dev_free(sd);
+out_unlock:
+    mutex_unlock(&stack_devs_lock);
+    return ret;
+}
+
+// インスタンスを削除する(stack_devs_lockを持って呼ぶ)
+// デバイスファイルを消して待っている操作を-ENODEVで失敗させ、作成時の参照を手放す
+// 開いているファイルが残っていれば、メモリはそれらが閉じられたときに解放される
+static void stack_dev_destroy(struct stack_dev *sd)
+{
+    // REDIRECTがstack_devsから引き終わるのを待ってから参照を手放す
+    RCU_INIT_POINTER(stack_devs[sd->id], NULL);
+    synchronize_rcu();
+
+    debugfs_remove(sd->debugfs);
+    device_destroy(&stack_class, sd->stream_dev->devt);
+    cdev_device_del(&sd->cdev, &sd->dev);
+
+    WRITE_ONCE(sd->dead, true);
+    wake_up_interruptible_all(&sd->read_wq);
+    wake_up_interruptible_all(&sd->write_wq);
+    stack_dev_put(sd);
+}
+
+// シュリンカが回収できるメッセージ数を返す
+// drop_oldestのインスタンスに積まれているメッセージだけが対象
+// プールのメッセージは実行時にアロケータを呼ばずに済むように確保しておくものなので回収しない
+static unsigned long stack_shrink_count(struct shrinker *shrink, struct shrink_control *sc)
+{
+    unsigned long count = 0;
+    struct stack_dev *sd;
+    unsigned int i;
+
+    // インスタンスの作成中にメモリ回収から呼ばれることがあるので待たない
+    if (!mutex_trylock(&stack_devs_lock)) {
+        return 0;
+    }
+    for (i = 0; i < nr_stack_devs; i++) {
+        sd = stack_dev_at(i);
+        if (sd->ring == NULL && READ_ONCE(sd->policy) == STACK_POLICY_DROP_OLDEST) {
+            count += stack_depth(sd);
+        }
+    }
+    mutex_unlock(&stack_devs_lock);
+    return count;
+}
+
+// メモリが足りないときにdrop_oldestのインスタンスから古いメッセージを捨てる
+static unsigned long stack_shrink_scan(struct shrinker *shrink, struct shrink_control *sc)
+{
+    unsigned long freed = 0;
+    struct stack_dev *sd;
+    unsigned int i;
+
+    if (!mutex_trylock(&stack_devs_lock)) {
+        return SHRINK_STOP;
+    }
+    for (i = 0; i < nr_stack_devs && freed < sc->nr_to_scan; i++) {
+        sd = stack_dev_at(i);
+        while (freed < sc->nr_to_scan && sd->ring == NULL &&
+               READ_ONCE(sd->policy) == STACK_POLICY_DROP_OLDEST && stack_drop_one(sd)) {
+            freed++;
+        }
+    }
+    mutex_unlock(&stack_devs_lock);
+    return freed;
+}
+
+static struct shrinker stack_shrinker = {
+    .count_objects  = stack_shrink_count,
+    .scan_objects   = stack_shrink_scan,
+    .seeks          = DEFAULT_SEEKS,
+};
+
+// probe関数
+static int stack_probe(struct platform_device *pdev)
+{
+    unsigned int i;
+    int ret;
+    printk("STACK Probe\n");
+
+    mutex_lock(&stack_devs_lock);
+    stack_devs_closed = false;
+    mutex_unlock(&stack_devs_lock);
+
+    // instancesの数だけインスタンスを作成する
+    for (i = 0; i < instances; i++) {
+        ret = stack_dev_create(&pdev->dev, stack_default_discipline);
+        if (ret != 0) {
+            dev_err(&pdev->dev, "failed to create device.\n");
+            mutex_lock(&stack_devs_lock);
+            stack_devs_closed = true;
+            while (nr_stack_devs > 0) {
+                stack_dev_destroy(stack_dev_at(--nr_stack_devs));
+            }
+            mutex_unlock(&stack_devs_lock);
+            return ret;
+        }
+    }
+    return 0;
+}
+
+// remove関数
+static int stack_remove(struct platform_device *pdev)
+{
+    printk("STACK Remove\n");
+    // すべてのインスタンスを削除する
+    mutex_lock(&stack_devs_lock);
+    stack_devs_closed = true;
+    while (nr_stack_devs > 0) {
+        stack_dev_destroy(stack_dev_at(--nr_stack_devs));
+    }
+    mutex_unlock(&stack_devs_lock);
+    return 0;
+}
+
+// platform_driver構造体
+static struct platform_driver stack_driver = {
+    .probe  = stack_probe,
+    .remove = stack_remove,
+    .driver = {
+        .name   = DEV_NAME,
+        .owner  = THIS_MODULE,
+     },
+};
+
+// platform_device構造体へのポインタ
+static struct platform_device *pdev;
+
+// 初期化関数
+static int __init stack_init(void)
+{
+    int ret = 0;
+    printk("STACK Init\n");
+
+    if (instances > STACK_MAX_INSTANCES) {
+        return -EINVAL;
+    }
+    ret = sysfs_match_string(stack_discipline_names, discipline);
+    if (ret < 0) {
+        return ret;
+    }
+    stack_default_discipline = ret;
+
+    // メッセージのプールを確保
+    ret = stack_pool_init();
+    if (ret != 0) {
+        stack_pool_exit();
+        return ret;
+    }
+
+    // BPFプログラムをpushのフックとしてアタッチできるようにする
+    // BTFがないカーネルでは登録できないが、フックを使わなければ動作に影響はない
+    ret = register_btf_fmodret_id_set(&stack_bpf_fmodret_set);
+    if (ret == 0) {
+        ret = register_btf_kfunc_id_set(BPF_PROG_TYPE_TRACING, &stack_bpf_kfunc_set);
+    }
+    if (ret != 0) {
+        printk("STACK Init: BPF hook is not available %d\n", ret);
+    }
+    stack_bpf_ready = true;
+    if (bpf_hook) {
+        static_branch_enable(&stack_bpf_key);
+    }
+
+    // メモリが足りないときにメッセージを回収できるようにする
+    ret = register_shrinker(&stack_shrinker, DEV_NAME);
+    if (ret != 0) {
+        stack_pool_exit();
+        return ret;
+    }
+
+    // クラスの登録
+    ret = class_register(&stack_class);
+    if (ret != 0) {
+        unregister_shrinker(&stack_shrinker);
+        stack_pool_exit();
+        return ret;
+    }
+    printk("STACK Init: class_register OK\n");
+
+    // プラットフォームバスにデバイスを登録
+    ret = platform_driver_register(&stack_driver);
+    if (ret != 0) {
+        printk("STACK Init: platform_driver_register is err %d\n", ret);
+        class_unregister(&stack_class);
+        unregister_shrinker(&stack_shrinker);
+        stack_pool_exit();
+        return ret;
+    }
+    printk("STACK Init: platform_driver_register OK\n");
+
+    // キャラクタドライバのマイナー番号を確保
+    // メジャー番号は動的に割り当て、インスタンスごとにSTACK_MINORS個ずつ使う
+    ret = alloc_chrdev_region(&stack_devt, 0, STACK_MAX_INSTANCES * STACK_MINORS, DEV_NAME);
+    if (ret != 0) {
+        printk("STACK Init: alloc_chrdev_region is err %d\n", ret);
+        platform_driver_unregister(&stack_driver);
+        class_unregister(&stack_class);
+        unregister_shrinker(&stack_shrinker);
+        stack_pool_exit();
+        return ret;
+    }
+    printk("STACK Init: alloc_chrdev_region OK\n");
+
+    // debugfsにディレクトリを作る(インスタンスごとのファイルはprobeで作る)
+    stack_debugfs = debugfs_create_dir(DEV_NAME, NULL);
+
+    // プラットフォームバスにデバイスを登録
+    pdev = platform_device_register_simple(DEV_NAME, -1, NULL, 0);
+    if (IS_ERR(pdev)) {
+        ret = PTR_ERR(pdev);
+        printk("STACK Init: platform_device_register_simple is err %d\n", ret);
+        debugfs_remove(stack_debugfs);
+        unregister_chrdev_region(stack_devt, STACK_MAX_INSTANCES * STACK_MINORS);
+        platform_driver_unregister(&stack_driver);
+        class_unregister(&stack_class);
+        unregister_shrinker(&stack_shrinker);
+        stack_pool_exit();
+        return ret;
+    }
+    printk("STACK Init: platform_device_register_simple is OK\n");
+
+    return ret;
+}
+
+// 終了関数
+static void __exit stack_exit(void)
+{
+    printk("STACK Exit\n");
+    platform_device_unregister(pdev);   // プラットフォームバスからデバイスの登録を解除(全インスタンスを削除)
+    debugfs_remove(stack_debugfs);  // debugfsのディレクトリを削除
+    unregister_chrdev_region(stack_devt, STACK_MAX_INSTANCES * STACK_MINORS);  // マイナー番号を解放
+    platform_driver_unregister(&stack_driver);   // プラットフォームバスからドライバの登録を解除
+    class_unregister(&stack_class);  // クラス登録の解除
+    unregister_shrinker(&stack_shrinker);  // シュリンカの登録を解除
+    stack_pool_exit();  // プールとslabキャッシュを解放
+}
+
+module_init(stack_init);
+module_exit(stack_exit);
+MODULE_LICENSE("GPL");
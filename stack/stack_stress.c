@@ -0,0 +1,267 @@
+// /dev/stackNに複数のプロセス(スレッド)から同時にpush/popするストレステスト
+// プロデューサとコンシューマのスレッドを指定した数だけ動かし、取り出したメッセージを確かめて
+// 失われたメッセージ、重複したメッセージ、壊れたメッセージの数とスループットをJSONで出力する
+// どれか1つでも0でなければ終了コード1で失敗する
+//
+// 使い方: ./stack_stress [-d /dev/stack0] [-p producers] [-c consumers] [-n messages]
+//   メッセージは"プロデューサ番号:通し番号"(16進)の文字列で、プロデューサごとにn個pushする
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+
+#define MSG_LEN 10      // モジュールが受け付ける最小のメッセージ長に収める
+
+// コマンドライン引数
+static const char *dev = "/dev/stack0";
+static unsigned int producers = 4;
+static unsigned int consumers = 4;
+static unsigned long messages = 10000;  // プロデューサ1つあたりのメッセージ数
+
+// まだコンシューマが受け持っていないメッセージ数
+// コンシューマは取り出す前にここから1つ確保するので、空のまま待ち続けることはない
+static unsigned long unclaimed;
+static pthread_mutex_t claim_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// 取り出したメッセージに印を付ける(プロデューサ番号 * messages + 通し番号)
+static unsigned char *seen;
+static unsigned long duplicated;
+static unsigned long corrupted;
+
+// スレッドごとの状態
+struct worker {
+    pthread_t thread;
+    unsigned int id;
+    int err;                // 失敗したときのerrno
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// 満杯や空で今は処理できないだけのエラーか
+static bool busy(int err)
+{
+    return err == EAGAIN || err == ENODATA || err == ENOMEM || err == ENOSPC;
+}
+
+// 残っているメッセージを1つ自分の分として確保する
+static bool claim(void)
+{
+    bool ok;
+
+    pthread_mutex_lock(&claim_lock);
+    ok = unclaimed > 0;
+    if (ok) {
+        unclaimed--;
+    }
+    pthread_mutex_unlock(&claim_lock);
+    return ok;
+}
+
+// 1メッセージをpushする。満杯のときは空くまでやり直す
+static int push_msg(const char *buf, size_t len)
+{
+    int fd, err;
+
+    for (;;) {
+        fd = open(dev, O_WRONLY | O_NONBLOCK);
+        if (fd < 0) {
+            if (busy(errno)) {
+                sched_yield();
+                continue;
+            }
+            return errno;
+        }
+        err = write(fd, buf, len) == (ssize_t)len ? 0 : errno;
+        // closeしたときにpushされる
+        if (close(fd) != 0 && err == 0) {
+            err = errno;
+        }
+        return err;
+    }
+}
+
+// 1メッセージをpopする。空のときは積まれるまでやり直す
+static int pop_msg(char *buf, size_t size, ssize_t *len)
+{
+    int fd, err = 0;
+
+    for (;;) {
+        // openしたときにpopされる
+        fd = open(dev, O_RDONLY | O_NONBLOCK);
+        if (fd < 0) {
+            if (busy(errno)) {
+                sched_yield();
+                continue;
+            }
+            return errno;
+        }
+        *len = read(fd, buf, size);
+        if (*len < 0) {
+            err = errno;
+        }
+        close(fd);
+        return err;
+    }
+}
+
+// 取り出したメッセージを確かめ、取り出したことを記録する
+static void check_msg(const char *buf, ssize_t len)
+{
+    unsigned int producer;
+    unsigned long seq;
+    char str[MSG_LEN + 1];
+    int n = -1;
+
+    if (len <= 0 || len > MSG_LEN) {
+        __atomic_add_fetch(&corrupted, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    memcpy(str, buf, len);
+    str[len] = '\0';
+    if (sscanf(str, "%x:%lx%n", &producer, &seq, &n) != 2 || n != len ||
+        producer >= producers || seq >= messages) {
+        __atomic_add_fetch(&corrupted, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    if (__atomic_exchange_n(&seen[(size_t)producer * messages + seq], 1, __ATOMIC_RELAXED)) {
+        __atomic_add_fetch(&duplicated, 1, __ATOMIC_RELAXED);
+    }
+}
+
+// プロデューサスレッド
+static void *producer(void *arg)
+{
+    struct worker *w = arg;
+    char buf[MSG_LEN + 1];
+    unsigned long seq;
+    int len;
+
+    for (seq = 0; seq < messages; seq++) {
+        len = snprintf(buf, sizeof(buf), "%x:%lx", w->id, seq);
+        w->err = push_msg(buf, len);
+        if (w->err != 0) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+// コンシューマスレッド
+static void *consumer(void *arg)
+{
+    struct worker *w = arg;
+    char buf[64];
+    ssize_t len = 0;
+
+    while (claim()) {
+        w->err = pop_msg(buf, sizeof(buf), &len);
+        if (w->err != 0) {
+            break;
+        }
+        check_msg(buf, len);
+    }
+    return NULL;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-d dev] [-p producers] [-c consumers] [-n messages]\n", prog);
+    exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+    struct worker *prod, *cons;
+    unsigned long i, lost = 0;
+    uint64_t start, elapsed;
+    int opt, err = 0;
+
+    while ((opt = getopt(argc, argv, "d:p:c:n:h")) != -1) {
+        switch (opt) {
+        case 'd':
+            dev = optarg;
+            break;
+        case 'p':
+            producers = strtoul(optarg, NULL, 0);
+            break;
+        case 'c':
+            consumers = strtoul(optarg, NULL, 0);
+            break;
+        case 'n':
+            messages = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    // "ff:ffffff"がMSG_LENに収まる範囲
+    if (producers == 0 || producers > 0x100 || consumers == 0 || messages == 0 || messages > 0x1000000) {
+        usage(argv[0]);
+    }
+    unclaimed = producers * messages;
+
+    prod = calloc(producers, sizeof(*prod));
+    cons = calloc(consumers, sizeof(*cons));
+    seen = calloc(producers, messages);
+    if (prod == NULL || cons == NULL || seen == NULL) {
+        perror("calloc");
+        return 1;
+    }
+
+    start = now_ns();
+    for (i = 0; i < consumers; i++) {
+        cons[i].id = i;
+        pthread_create(&cons[i].thread, NULL, consumer, &cons[i]);
+    }
+    for (i = 0; i < producers; i++) {
+        prod[i].id = i;
+        pthread_create(&prod[i].thread, NULL, producer, &prod[i]);
+    }
+    for (i = 0; i < producers; i++) {
+        pthread_join(prod[i].thread, NULL);
+        if (prod[i].err != 0) {
+            fprintf(stderr, "producer %lu: %s\n", i, strerror(prod[i].err));
+            err = 1;
+        }
+    }
+    // プロデューサが失敗したときは残りが積まれないので、コンシューマには最後まで待たせない
+    if (err) {
+        for (i = 0; i < consumers; i++) {
+            pthread_cancel(cons[i].thread);
+        }
+    }
+    for (i = 0; i < consumers; i++) {
+        pthread_join(cons[i].thread, NULL);
+        if (cons[i].err != 0) {
+            fprintf(stderr, "consumer %lu: %s\n", i, strerror(cons[i].err));
+            err = 1;
+        }
+    }
+    elapsed = now_ns() - start;
+
+    for (i = 0; i < producers * messages; i++) {
+        lost += !seen[i];
+    }
+    printf("{\"device\":\"%s\",\"producers\":%u,\"consumers\":%u,\"messages\":%lu,\"elapsed_ns\":%lu,"
+           "\"msgs_per_sec\":%.0f,\"lost\":%lu,\"duplicated\":%lu,\"corrupted\":%lu}\n",
+           dev, producers, consumers, producers * messages, (unsigned long)elapsed,
+           producers * messages * 1e9 / elapsed, lost, duplicated, corrupted);
+    if (lost != 0 || duplicated != 0 || corrupted != 0) {
+        err = 1;
+    }
+    return err;
+}
@@ -0,0 +1,38 @@
+#!/bin/sh
+# stack_stressで単一スタックとシャードモードのスケーリングを比べる
+# sharded=0と1でstack.koを読み込み直し、スレッド数を1から倍々にNまで増やして
+# (プロデューサとコンシューマを同じ数だけ動かす)stack_stressの結果をJSONで1行ずつ出力する
+#
+# 使い方: sudo ./stack_sweep.sh [N] [stack_stressの引数...]
+#   N:            最大スレッド数(省略時はnproc)
+#   STACK_PARAMS: shardedのほかにstack.koに渡すパラメータ(環境変数)
+#   例: sudo ./stack_sweep.sh 16 -n 50000
+set -e
+
+cd "$(dirname "$0")"
+max=${1:-$(nproc)}
+if [ $# -gt 0 ]; then
+    shift
+fi
+
+for sharded in 0 1; do
+    if grep -q '^stack ' /proc/modules; then
+        rmmod stack
+    fi
+    insmod ./stack.ko sharded=$sharded $STACK_PARAMS
+    # デバイスファイルが作られるまで待つ
+    udevadm settle 2>/dev/null || sleep 1
+
+    threads=1
+    while :; do
+        ./stack_stress -p $threads -c $threads "$@" | sed "s/^{/{\"sharded\":$sharded,\"threads\":$threads,/"
+        if [ $threads -ge $max ]; then
+            break
+        fi
+        threads=$((threads * 2))
+        if [ $threads -gt $max ]; then
+            threads=$max
+        fi
+    done
+done
+rmmod stack
@@ -0,0 +1,249 @@
+#include <kunit/test.h>
+#include <linux/ktime.h>
+#include <linux/slab.h>
+
+#include "stack_core.h"
+
+// stack_core.cのKUnitテスト
+// ヒープとリストの並び順の確認と、push/popの所要時間の計測を行う
+// ハードウェアに触れないので、UMLやx86のQEMUでもstack.koを読み込めば実行できる
+
+#define STACK_TEST_MSGS     64      // 並び順を確認するメッセージ数
+#define STACK_BENCH_MSGS    1024    // 計測で積むメッセージ数
+#define STACK_BENCH_ROUNDS  100     // 計測でpush/popを繰り返す回数
+
+// n個のメッセージを用意する
+// 優先度は少ない種類に散らして、同じ優先度のメッセージが多くなるようにする
+static struct stack_msg *stack_test_msgs(struct kunit *test, unsigned int n)
+{
+    struct stack_msg *msgs;
+    unsigned int i;
+
+    msgs = kunit_kcalloc(test, n, sizeof(*msgs), GFP_KERNEL);
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, msgs);
+    for (i = 0; i < n; i++) {
+        msgs[i].prio = (i * 7 + 3) % 5;
+        msgs[i].seq = i;
+    }
+    return msgs;
+}
+
+// n個分のヒープの配列を用意する
+static struct stack_msg **stack_test_heap(struct kunit *test, unsigned int n)
+{
+    struct stack_msg **heap;
+
+    heap = kunit_kcalloc(test, n, sizeof(*heap), GFP_KERNEL);
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, heap);
+    return heap;
+}
+
+// 優先度の大きいものが先、同じ優先度なら番号の小さいものが先
+static void stack_test_msg_before(struct kunit *test)
+{
+    struct stack_msg a = { .prio = 2, .seq = 5 };
+    struct stack_msg b = { .prio = 1, .seq = 0 };
+    struct stack_msg c = { .prio = 2, .seq = 6 };
+
+    KUNIT_EXPECT_TRUE(test, stack_msg_before(&a, &b));
+    KUNIT_EXPECT_FALSE(test, stack_msg_before(&b, &a));
+    KUNIT_EXPECT_TRUE(test, stack_msg_before(&a, &c));
+    KUNIT_EXPECT_FALSE(test, stack_msg_before(&c, &a));
+    KUNIT_EXPECT_FALSE(test, stack_msg_before(&a, &a));
+}
+
+// ヒープからは優先度順に、同じ優先度ならpushされた順に取り出される
+static void stack_test_heap_order(struct kunit *test)
+{
+    struct stack_msg *msgs = stack_test_msgs(test, STACK_TEST_MSGS);
+    struct stack_msg **heap = stack_test_heap(test, STACK_TEST_MSGS);
+    struct stack_msg *prev = NULL;
+    unsigned int i, size = 0;
+
+    for (i = 0; i < STACK_TEST_MSGS; i++) {
+        stack_heap_push(heap, size++, &msgs[i]);
+    }
+    while (size > 0) {
+        if (prev != NULL) {
+            KUNIT_EXPECT_TRUE(test, stack_msg_before(prev, heap[0]));
+        }
+        prev = heap[0];
+        stack_heap_pop(heap, size--);
+    }
+}
+
+// stack_heap_firstはpopを繰り返したときと同じ順に並べる
+static void stack_test_heap_first(struct kunit *test)
+{
+    static const unsigned int maxes[] = { 0, 1, STACK_TEST_MSGS / 2, STACK_TEST_MSGS, STACK_TEST_MSGS + 5 };
+    struct stack_msg *msgs = stack_test_msgs(test, STACK_TEST_MSGS);
+    struct stack_msg **heap = stack_test_heap(test, STACK_TEST_MSGS);
+    struct stack_msg **copy = stack_test_heap(test, STACK_TEST_MSGS);
+    struct stack_msg **first = stack_test_heap(test, STACK_TEST_MSGS);
+    unsigned int *cand;
+    unsigned int i, j, n, size;
+
+    cand = kunit_kcalloc(test, STACK_TEST_MSGS + 6, sizeof(*cand), GFP_KERNEL);
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, cand);
+    for (i = 0; i < STACK_TEST_MSGS; i++) {
+        stack_heap_push(heap, i, &msgs[i]);
+    }
+    for (i = 0; i < ARRAY_SIZE(maxes); i++) {
+        n = stack_heap_first(heap, STACK_TEST_MSGS, first, maxes[i], cand);
+        KUNIT_EXPECT_EQ(test, n, min_t(unsigned int, maxes[i], STACK_TEST_MSGS));
+        // heapは書き換えないので、コピーからpopして比べる
+        memcpy(copy, heap, STACK_TEST_MSGS * sizeof(*heap));
+        for (j = 0, size = STACK_TEST_MSGS; j < n; j++) {
+            KUNIT_EXPECT_PTR_EQ(test, first[j], copy[0]);
+            stack_heap_pop(copy, size--);
+        }
+    }
+}
+
+// stack_heap_remove_lastは最後にpopされるメッセージを取り除き、ヒープを壊さない
+static void stack_test_heap_remove_last(struct kunit *test)
+{
+    struct stack_msg *msgs = stack_test_msgs(test, STACK_TEST_MSGS);
+    struct stack_msg **heap = stack_test_heap(test, STACK_TEST_MSGS);
+    struct stack_msg *last, *msg, *prev = NULL;
+    unsigned int i, size = 0;
+
+    for (i = 0; i < STACK_TEST_MSGS; i++) {
+        stack_heap_push(heap, size++, &msgs[i]);
+    }
+    // 先に一番後ろになるものを探しておく
+    last = heap[0];
+    for (i = 1; i < size; i++) {
+        if (stack_msg_before(last, heap[i])) {
+            last = heap[i];
+        }
+    }
+    msg = stack_heap_remove_last(heap, size--);
+    KUNIT_EXPECT_PTR_EQ(test, msg, last);
+    while (size > 0) {
+        KUNIT_EXPECT_PTR_NE(test, heap[0], last);
+        if (prev != NULL) {
+            KUNIT_EXPECT_TRUE(test, stack_msg_before(prev, heap[0]));
+        }
+        prev = heap[0];
+        stack_heap_pop(heap, size--);
+    }
+}
+
+// LIFOでは最後にpushしたものが先頭に来て、一番古いものは末尾にある
+static void stack_test_list_lifo(struct kunit *test)
+{
+    struct stack_msg *msgs = stack_test_msgs(test, STACK_TEST_MSGS);
+    struct stack_msg **first = stack_test_heap(test, STACK_TEST_MSGS);
+    unsigned int i, n;
+    LIST_HEAD(head);
+
+    KUNIT_EXPECT_NULL(test, stack_list_top(&head));
+    for (i = 0; i < STACK_TEST_MSGS; i++) {
+        stack_list_push(&head, &msgs[i], STACK_LIFO);
+        KUNIT_EXPECT_PTR_EQ(test, stack_list_top(&head), &msgs[i]);
+    }
+    n = stack_list_first(&head, first, STACK_TEST_MSGS / 2);
+    KUNIT_ASSERT_EQ(test, n, STACK_TEST_MSGS / 2);
+    for (i = 0; i < n; i++) {
+        KUNIT_EXPECT_PTR_EQ(test, first[i], &msgs[STACK_TEST_MSGS - 1 - i]);
+    }
+    for (i = 0; i < STACK_TEST_MSGS; i++) {
+        KUNIT_EXPECT_PTR_EQ(test, stack_list_remove_oldest(&head, STACK_LIFO), &msgs[i]);
+    }
+    KUNIT_EXPECT_TRUE(test, list_empty(&head));
+}
+
+// FIFOでは最初にpushしたものが先頭に来て、それが一番古い
+static void stack_test_list_fifo(struct kunit *test)
+{
+    struct stack_msg *msgs = stack_test_msgs(test, STACK_TEST_MSGS);
+    struct stack_msg **first = stack_test_heap(test, STACK_TEST_MSGS);
+    unsigned int i, n;
+    LIST_HEAD(head);
+
+    for (i = 0; i < STACK_TEST_MSGS; i++) {
+        stack_list_push(&head, &msgs[i], STACK_FIFO);
+        KUNIT_EXPECT_PTR_EQ(test, stack_list_top(&head), &msgs[0]);
+    }
+    n = stack_list_first(&head, first, STACK_TEST_MSGS + 5);
+    KUNIT_ASSERT_EQ(test, n, STACK_TEST_MSGS);
+    for (i = 0; i < n; i++) {
+        KUNIT_EXPECT_PTR_EQ(test, first[i], &msgs[i]);
+    }
+    for (i = 0; i < STACK_TEST_MSGS; i++) {
+        KUNIT_EXPECT_PTR_EQ(test, stack_list_remove_oldest(&head, STACK_FIFO), &msgs[i]);
+    }
+    KUNIT_EXPECT_TRUE(test, list_empty(&head));
+}
+
+// ヒープへのpush/popの所要時間を計測する
+static void stack_test_bench_heap(struct kunit *test)
+{
+    struct stack_msg *msgs = stack_test_msgs(test, STACK_BENCH_MSGS);
+    struct stack_msg **heap = stack_test_heap(test, STACK_BENCH_MSGS);
+    unsigned int i, r, size;
+    u64 start, ns;
+
+    start = ktime_get_ns();
+    for (r = 0; r < STACK_BENCH_ROUNDS; r++) {
+        for (size = 0; size < STACK_BENCH_MSGS; size++) {
+            stack_heap_push(heap, size, &msgs[size]);
+        }
+        while (size > 0) {
+            stack_heap_pop(heap, size--);
+        }
+        // 同じ優先度の中の順番が毎回変わるように番号を進める
+        for (i = 0; i < STACK_BENCH_MSGS; i++) {
+            msgs[i].seq += STACK_BENCH_MSGS;
+        }
+    }
+    ns = ktime_get_ns() - start;
+    kunit_info(test, "heap push+pop: %llu ns/msg (%u msgs x %u rounds)\n",
+               div_u64(ns, STACK_BENCH_MSGS * STACK_BENCH_ROUNDS), STACK_BENCH_MSGS, STACK_BENCH_ROUNDS);
+}
+
+// リストへのpush/popの所要時間を計測する
+static void stack_test_bench_list(struct kunit *test)
+{
+    static const enum stack_discipline disciplines[] = { STACK_LIFO, STACK_FIFO };
+    struct stack_msg *msgs = stack_test_msgs(test, STACK_BENCH_MSGS);
+    struct stack_msg *msg;
+    unsigned int d, i, r;
+    u64 start, ns;
+    LIST_HEAD(head);
+
+    for (d = 0; d < ARRAY_SIZE(disciplines); d++) {
+        start = ktime_get_ns();
+        for (r = 0; r < STACK_BENCH_ROUNDS; r++) {
+            for (i = 0; i < STACK_BENCH_MSGS; i++) {
+                stack_list_push(&head, &msgs[i], disciplines[d]);
+            }
+            while ((msg = stack_list_top(&head)) != NULL) {
+                list_del(&msg->list);
+            }
+        }
+        ns = ktime_get_ns() - start;
+        kunit_info(test, "%s push+pop: %llu ns/msg (%u msgs x %u rounds)\n",
+                   disciplines[d] == STACK_LIFO ? "lifo" : "fifo",
+                   div_u64(ns, STACK_BENCH_MSGS * STACK_BENCH_ROUNDS), STACK_BENCH_MSGS, STACK_BENCH_ROUNDS);
+    }
+}
+
+static struct kunit_case stack_test_cases[] = {
+    KUNIT_CASE(stack_test_msg_before),
+    KUNIT_CASE(stack_test_heap_order),
+    KUNIT_CASE(stack_test_heap_first),
+    KUNIT_CASE(stack_test_heap_remove_last),
+    KUNIT_CASE(stack_test_list_lifo),
+    KUNIT_CASE(stack_test_list_fifo),
+    KUNIT_CASE(stack_test_bench_heap),
+    KUNIT_CASE(stack_test_bench_list),
+    {}
+};
+
+static struct kunit_suite stack_test_suite = {
+    .name = "stack",
+    .test_cases = stack_test_cases,
+};
+kunit_test_suite(stack_test_suite);
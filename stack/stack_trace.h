@@ -0,0 +1,107 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM stack
+
+#if !defined(_STACK_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _STACK_TRACE_H
+
+#include <linux/tracepoint.h>
+
+// open: どのインスタンスをどのモードで開いたか
+TRACE_EVENT(stack_open,
+    TP_PROTO(unsigned int instance, bool stream, fmode_t mode),
+    TP_ARGS(instance, stream, mode),
+    TP_STRUCT__entry(
+        __field(unsigned int, instance)
+        __field(bool, stream)
+        __field(unsigned int, mode)
+    ),
+    TP_fast_assign(
+        __entry->instance = instance;
+        __entry->stream = stream;
+        __entry->mode = (__force unsigned int)mode;
+    ),
+    TP_printk("instance=%u stream=%d mode=0x%x", __entry->instance, __entry->stream, __entry->mode)
+);
+
+// release: releaseの結果(通常モードの書き込みではpushの結果)
+TRACE_EVENT(stack_release,
+    TP_PROTO(unsigned int instance, int ret),
+    TP_ARGS(instance, ret),
+    TP_STRUCT__entry(
+        __field(unsigned int, instance)
+        __field(int, ret)
+    ),
+    TP_fast_assign(
+        __entry->instance = instance;
+        __entry->ret = ret;
+    ),
+    TP_printk("instance=%u ret=%d", __entry->instance, __entry->ret)
+);
+
+// read/write: 要求されたバイト数と転送できたバイト数(またはエラー)
+DECLARE_EVENT_CLASS(stack_rw,
+    TP_PROTO(unsigned int instance, size_t count, loff_t pos, ssize_t ret),
+    TP_ARGS(instance, count, pos, ret),
+    TP_STRUCT__entry(
+        __field(unsigned int, instance)
+        __field(size_t, count)
+        __field(loff_t, pos)
+        __field(ssize_t, ret)
+    ),
+    TP_fast_assign(
+        __entry->instance = instance;
+        __entry->count = count;
+        __entry->pos = pos;
+        __entry->ret = ret;
+    ),
+    TP_printk("instance=%u count=%zu pos=%lld ret=%zd",
+              __entry->instance, __entry->count, __entry->pos, __entry->ret)
+);
+
+DEFINE_EVENT(stack_rw, stack_read,
+    TP_PROTO(unsigned int instance, size_t count, loff_t pos, ssize_t ret),
+    TP_ARGS(instance, count, pos, ret)
+);
+
+DEFINE_EVENT(stack_rw, stack_write,
+    TP_PROTO(unsigned int instance, size_t count, loff_t pos, ssize_t ret),
+    TP_ARGS(instance, count, pos, ret)
+);
+
+// push/pop: メッセージの大きさと優先度、処理後に積まれているメッセージ数
+DECLARE_EVENT_CLASS(stack_msg,
+    TP_PROTO(unsigned int instance, size_t len, u32 prio, unsigned int depth),
+    TP_ARGS(instance, len, prio, depth),
+    TP_STRUCT__entry(
+        __field(unsigned int, instance)
+        __field(size_t, len)
+        __field(u32, prio)
+        __field(unsigned int, depth)
+    ),
+    TP_fast_assign(
+        __entry->instance = instance;
+        __entry->len = len;
+        __entry->prio = prio;
+        __entry->depth = depth;
+    ),
+    TP_printk("instance=%u len=%zu prio=%u depth=%u",
+              __entry->instance, __entry->len, __entry->prio, __entry->depth)
+);
+
+DEFINE_EVENT(stack_msg, stack_push,
+    TP_PROTO(unsigned int instance, size_t len, u32 prio, unsigned int depth),
+    TP_ARGS(instance, len, prio, depth)
+);
+
+DEFINE_EVENT(stack_msg, stack_pop,
+    TP_PROTO(unsigned int instance, size_t len, u32 prio, unsigned int depth),
+    TP_ARGS(instance, len, prio, depth)
+);
+
+#endif
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE stack_trace
+#include <trace/define_trace.h>
@@ -5,88 +5,347 @@
 #include <linux/slab.h>
 #include <linux/kernel.h>
 #include <linux/string.h>
-#include <asm/io.h>
+#include <linux/percpu.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/cpu.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/jump_label.h>
+#include <linux/atomic.h>
+#include <linux/interrupt.h>
+#include <linux/gpio/consumer.h>
+#include <linux/gpio/machine.h>
+#include <linux/hrtimer.h>
+#include <linux/kfifo.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/mutex.h>
+
+#define CREATE_TRACE_POINTS
+#include "sw_trace.h"
+
+#include "bcm2837_gpio.h"
+#include "op_stats.h"
 
 #define DEV_NAME "sw"
 #define SW_MAJOR_NUM 60
 
-// raspberry pi 3のペリフェラルIOの物理アドレス
-#define BCM2837_PERI_BASE   0x3F000000
-#define GPIO_BASE_ADDR      (BCM2837_PERI_BASE + 0x200000)
+// 使用するSWピン番号
+#define SW_PIN             18
 
-// GPIO Function Select 1のレジスタ
-#define GPFSEL1             0x04
+// SWのピン(probeでgpiolibから取得し、デバイスが削除されるまで使い続ける)
+static struct gpio_desc *sw_gpiod;
 
-// GPIO Pin Output Set 0のレジスタ
-#define GPSET0              0x1C
+// SWのピンを持つGPIOコントローラのラベル
+// GPIO番号はカーネルによって動的に割り当てられるので、コントローラとピン番号で引く
+static char *gpiochip = "pinctrl-bcm2835";
+module_param(gpiochip, charp, 0444);
+MODULE_PARM_DESC(gpiochip, "label of the GPIO controller that has the switch pin");
 
-// GPIO Pin Output Clear 0のレジスタ
-#define GPCLR0              0x28
+// simモジュールパラメータを指定したときはPi以外でも動かせるように
+// GPIOコントローラの代わりにメモリ上の疑似レジスタを読む
+static bool sim;
+module_param(sim, bool, 0444);
+MODULE_PARM_DESC(sim, "use simulated GPIO registers instead of the BCM2837 GPIO block");
 
-// 使用するSWピン番号
-#define SW_PIN             18
+static DEFINE_STATIC_KEY_FALSE(sw_sim_key);
+
+// 疑似レジスタ
+// debugfsのsim_gplev0に書き込むとSWの状態を変えられる(割り込みの代わりにエッジ検出も行う)
+static atomic_t sw_sim_regs[MEM_SIZE / 4];
+
+// SWの入力を読む
+// ピンはgpiolibが入力に設定して管理しているので、GPIOレジスタは直接読まない
+static int sw_read_level(void)
+{
+    if (static_branch_unlikely(&sw_sim_key)) {
+        return gpio_level(atomic_read(&sw_sim_regs[gpio_lev_reg(SW_PIN) / 4]), SW_PIN);
+    }
+    return gpiod_get_value(sw_gpiod);
+}
+
+// SWのピンをgpiochipのSW_PIN番として引けるようにする
+// keyはsw_initでgpiochipパラメータから設定する
+static struct gpiod_lookup_table sw_gpio_table = {
+    .dev_id = DEV_NAME,
+    .table = {
+        GPIO_LOOKUP(NULL, SW_PIN, NULL, GPIO_ACTIVE_HIGH),
+        { },
+    },
+};
+
+// レイテンシを計測するファイル操作
+enum sw_op {
+    SW_OP_OPEN,
+    SW_OP_RELEASE,
+    SW_OP_READ,
+    SW_OP_WRITE,
+    SW_NR_OPS,
+};
 
-// 確保するメモリサイズ
-#define MEM_SIZE 0x60
+static const char * const sw_op_names[] = {
+    [SW_OP_OPEN] = "open",
+    [SW_OP_RELEASE] = "release",
+    [SW_OP_READ] = "read",
+    [SW_OP_WRITE] = "write",
+};
+
+// CPUごとのファイル操作の統計
+static DEFINE_PER_CPU(struct op_stats, sw_op_stats);
 
-unsigned int *gpio;
+// ファイル操作1回分の統計を自CPUの分に記録する
+// startは操作の開始時刻(ktime_get_ns)、retは操作の戻り値
+static void sw_stat_op(enum sw_op op, u64 start, ssize_t ret)
+{
+    BUILD_BUG_ON(SW_NR_OPS > OP_STATS_MAX_OPS);
+    op_stats_record(&sw_op_stats, op, op == SW_OP_READ || op == SW_OP_WRITE, start, ret);
+}
+
+// エッジを検出してから入力が変化しなくなるまで待つ時間(マイクロ秒)
+// 0のときは割り込みのたびにすぐに入力を読む
+static unsigned int debounce_us = 5000;
+module_param(debounce_us, uint, 0644);
+MODULE_PARM_DESC(debounce_us, "switch debounce time in microseconds (0 disables debouncing)");
+
+// openしたファイルごとにためておけるイベント数
+#define SW_EVENTS 64
+
+// SWの入力の変化
+struct sw_event {
+    u64 timestamp;      // 変化を確定した時刻(ktime_get_ns)
+    u32 value;          // 変化後の入力(1なら立ち上がり、0なら立ち下がり)
+};
+
+// openしたファイルごとの状態
+// エッジを検出すると開いているすべてのファイルのfifoにイベントを積む
+struct sw_file {
+    struct list_head list;
+    DECLARE_KFIFO(fifo, struct sw_event, SW_EVENTS);
+    struct mutex lock;  // 同じファイルからのreadを直列化する
+    char line[32];      // 送信中のイベントの文字列
+    size_t len;
+    size_t off;         // lineの送信済みのバイト数
+};
+
+static DEFINE_SPINLOCK(sw_lock);        // sw_filesと各ファイルのfifo、sw_levelを保護する
+static LIST_HEAD(sw_files);
+static DECLARE_WAIT_QUEUE_HEAD(sw_wq);  // イベントを待つ
+static int sw_level;                    // 最後に確定した入力
+static struct hrtimer sw_debounce_timer;
+static int sw_irq = -1;                 // 疑似レジスタを使うときは-1
+
+// 入力を読んで、前に確定した値から変わっていればイベントを積む
+// 割り込みハンドラかチャタリング除去のタイマから呼ばれる
+static void sw_sample(void)
+{
+    struct sw_event ev;
+    struct sw_file *f;
+    unsigned long flags;
+    bool changed;
+
+    ev.timestamp = ktime_get_ns();
+    ev.value = sw_read_level();
+
+    spin_lock_irqsave(&sw_lock, flags);
+    changed = ev.value != sw_level;
+    if (changed) {
+        sw_level = ev.value;
+        // 読み出しが追いつかずにfifoが満杯のファイルには新しいイベントを積まない
+        list_for_each_entry(f, &sw_files, list) {
+            kfifo_put(&f->fifo, ev);
+        }
+    }
+    spin_unlock_irqrestore(&sw_lock, flags);
+    if (changed) {
+        wake_up_interruptible(&sw_wq);
+    }
+}
+
+// チャタリング除去のタイマ関数
+// 最後のエッジからdebounce_usだけ入力が変化しなかったので入力を確定する
+static enum hrtimer_restart sw_debounce_fn(struct hrtimer *timer)
+{
+    sw_sample();
+    return HRTIMER_NORESTART;
+}
+
+// エッジを検出したときの処理
+// チャタリング中はエッジのたびにタイマをかけ直し、入力が落ち着くまで待つ
+static void sw_edge(void)
+{
+    unsigned int us = READ_ONCE(debounce_us);
+
+    if (us == 0) {
+        sw_sample();
+        return;
+    }
+    hrtimer_start(&sw_debounce_timer, ns_to_ktime((u64)us * NSEC_PER_USEC), HRTIMER_MODE_REL);
+}
+
+// 立ち上がり/立ち下がりの割り込みハンドラ
+static irqreturn_t sw_irq_handler(int irq, void *dev_id)
+{
+    sw_edge();
+    return IRQ_HANDLED;
+}
+
+// sim_gplev0ファイルのget関数
+static int sw_sim_lev_get(void *data, u64 *val)
+{
+    *val = atomic_read(&sw_sim_regs[GPLEV0 / 4]);
+    return 0;
+}
+
+// sim_gplev0ファイルのset関数
+// 疑似レジスタでは割り込みが入らないので、値が変わったらここでエッジを検出する
+static int sw_sim_lev_set(void *data, u64 val)
+{
+    if (atomic_xchg(&sw_sim_regs[GPLEV0 / 4], val) != (u32)val) {
+        sw_edge();
+    }
+    return 0;
+}
+DEFINE_DEBUGFS_ATTRIBUTE(sw_sim_lev_fops, sw_sim_lev_get, sw_sim_lev_set, "0x%08llx\n");
 
 // openハンドラ
+// 開いた時点の入力を最初のイベントとして積んでおく
 static int sw_open(struct inode *inode, struct file *file)
 {
-    printk("SW Open\n");
-    return 0;
+    struct sw_event ev = { .timestamp = ktime_get_ns() };
+    u64 start = ev.timestamp;
+    struct sw_file *f;
+
+    trace_sw_open(iminor(inode));
+    f = kzalloc(sizeof(*f), GFP_KERNEL);
+    if (f == NULL) {
+        sw_stat_op(SW_OP_OPEN, start, -ENOMEM);
+        return -ENOMEM;
+    }
+    INIT_KFIFO(f->fifo);
+    mutex_init(&f->lock);
+
+    spin_lock_irq(&sw_lock);
+    ev.value = sw_level;
+    kfifo_put(&f->fifo, ev);
+    list_add_tail(&f->list, &sw_files);
+    spin_unlock_irq(&sw_lock);
+
+    file->private_data = f;
+    sw_stat_op(SW_OP_OPEN, start, 0);
+    return stream_open(inode, file);
 }
 
 // releaseハンドラ
 static int sw_release(struct inode *inode, struct file *file)
 {
-    printk("SW Release\n");
+    struct sw_file *f = file->private_data;
+    u64 start = ktime_get_ns();
+
+    trace_sw_release(iminor(inode));
+    spin_lock_irq(&sw_lock);
+    list_del(&f->list);
+    spin_unlock_irq(&sw_lock);
+    kfree(f);
+    sw_stat_op(SW_OP_RELEASE, start, 0);
     return 0;
 }
 
 // writeハンドラ
 static ssize_t sw_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
 {
-    printk("SW Write\n");
+    u64 start = ktime_get_ns();
+
+    trace_sw_write(count);
+    sw_stat_op(SW_OP_WRITE, start, count);
     return count;
 }
 
-// readハンドラ
-static ssize_t sw_read(struct file *file, char __user *buf, size_t count, loff_t *ppos)
+// ファイルのfifoからイベントを1つ取り出す
+static bool sw_get_event(struct sw_file *f, struct sw_event *ev)
 {
-    int len, val;
-    char *msg;
-    printk("SW Read\n");
-    
-    msg = kmalloc(2, GFP_KERNEL);
-    if (msg == NULL) {
-        return -ENOMEM;
-    }
-    request_mem_region(GPIO_BASE_ADDR, MEM_SIZE, DEV_NAME);
-    gpio = ioremap(GPIO_BASE_ADDR, MEM_SIZE);
+    return kfifo_out_spinlocked(&f->fifo, ev, 1, &sw_lock) == 1;
+}
 
-    // SWの状態を読み取る
-    val = (gpio[13] & (1 << (SW_PIN % 32))) != 0;
-    sprintf(msg, "%d\n", val);
-    
-    len = strlen(msg);
-    if (len - *ppos == 0) {
-        return 0;
-    }
-    if (count > len - *ppos) {
-        count = len - *ppos;
+// f->lockを取ってイベントを読み出す
+static ssize_t sw_read_events_locked(struct file *file, char __user *buf, size_t count, loff_t *ppos)
+{
+    struct sw_file *f = file->private_data;
+    struct sw_event ev;
+    size_t done = 0, n;
+    int ret;
+
+    while (done < count) {
+        // 送信途中の行があれば続きを送る
+        if (f->off < f->len) {
+            n = min(count - done, f->len - f->off);
+            if (copy_to_user(buf + done, f->line + f->off, n)) {
+                return done ? done : -EFAULT;
+            }
+            f->off += n;
+            done += n;
+            continue;
+        }
+        if (!sw_get_event(f, &ev)) {
+            if (done > 0) {
+                break;
+            }
+            if (file->f_flags & O_NONBLOCK) {
+                return -EAGAIN;
+            }
+            ret = wait_event_interruptible(sw_wq, !kfifo_is_empty(&f->fifo));
+            if (ret != 0) {
+                return ret;
+            }
+            continue;
+        }
+        trace_sw_read(SW_PIN, ev.value, count, *ppos);
+        f->len = scnprintf(f->line, sizeof(f->line), "%u %llu\n", ev.value, ev.timestamp);
+        f->off = 0;
     }
-    if (copy_to_user(buf, msg, len)) {
-        return -EFAULT;
+    return done;
+}
+
+// イベントを"<入力> <時刻(ナノ秒)>\n"の行で返す
+// 行の先頭は入力なので、これまでどおり"0"か"1"として読める
+// イベントがないときは入力が変化するまで待つ(O_NONBLOCKのときは-EAGAINを返す)
+static ssize_t sw_read_events(struct file *file, char __user *buf, size_t count, loff_t *ppos)
+{
+    struct sw_file *f = file->private_data;
+    ssize_t ret;
+
+    if (mutex_lock_interruptible(&f->lock)) {
+        return -ERESTARTSYS;
     }
-    *ppos += count;
+    ret = sw_read_events_locked(file, buf, count, ppos);
+    mutex_unlock(&f->lock);
+    return ret;
+}
 
+// readハンドラ
+static ssize_t sw_read(struct file *file, char __user *buf, size_t count, loff_t *ppos)
+{
+    u64 start = ktime_get_ns();
+    ssize_t ret;
 
-    iounmap((void*)gpio);
-    release_mem_region(GPIO_BASE_ADDR, MEM_SIZE);
+    ret = sw_read_events(file, buf, count, ppos);
+    sw_stat_op(SW_OP_READ, start, ret);
+    return ret;
+}
 
-    return count;
+// pollハンドラ
+// 読み出せるイベントがあるときはEPOLLINを返す
+static __poll_t sw_poll(struct file *file, poll_table *wait)
+{
+    struct sw_file *f = file->private_data;
+
+    poll_wait(file, &sw_wq, wait);
+    if (f->off < f->len || !kfifo_is_empty(&f->fifo)) {
+        return EPOLLIN | EPOLLRDNORM;
+    }
+    return 0;
 }
 
 // ファイル操作構造体
@@ -96,6 +355,40 @@ static const struct file_operations sw_fops = {
     .release = sw_release,
     .read    = sw_read,
     .write   = sw_write,
+    .poll    = sw_poll,
+    .llseek  = no_llseek,
+};
+
+// debugfsのswディレクトリ
+static struct dentry *sw_debugfs;
+
+// statsファイルのshow関数
+// 全CPU分を読み出したときに合計する
+static int sw_stats_show(struct seq_file *m, void *v)
+{
+    return op_stats_show(m, &sw_op_stats, sw_op_names, SW_NR_OPS);
+}
+
+// statsファイルのwrite関数
+// "0"を書き込むと全CPUの統計を0に戻す(同時に行われている操作とは同期しない近似的なもの)
+static ssize_t sw_stats_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
+{
+    return op_stats_write(buf, count, &sw_op_stats, sizeof(struct op_stats));
+}
+
+static int sw_stats_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, sw_stats_show, NULL);
+}
+
+// debugfsのstatsファイルの操作構造体
+static const struct file_operations sw_stats_fops = {
+    .owner   = THIS_MODULE,
+    .open    = sw_stats_open,
+    .read    = seq_read,
+    .write   = sw_stats_write,
+    .llseek  = seq_lseek,
+    .release = single_release,
 };
 
 // class構造体
@@ -108,22 +401,45 @@ static struct class sw_class = {
 static int sw_probe(struct platform_device *pdev)
 {
     struct device *dev;
+    int ret;
     printk("SW Probe\n");
 
-    request_mem_region(GPIO_BASE_ADDR, MEM_SIZE, DEV_NAME);
-    gpio = ioremap(GPIO_BASE_ADDR, MEM_SIZE);
-    // GPIO18を入力に設定
-    gpio[GPFSEL1 / 4] &= ~(0x7 << ((SW_PIN % 10) * 3));
-    gpio[GPFSEL1 / 4] |= (0x0 << ((SW_PIN % 10) * 3));
+    // GPIO18を入力として取得する(解放はデバイスの削除時に自動で行われる)
+    if (!sim) {
+        sw_gpiod = devm_gpiod_get(&pdev->dev, NULL, GPIOD_IN);
+        if (IS_ERR(sw_gpiod)) {
+            dev_err(&pdev->dev, "failed to get GPIO %d of %s.\n", SW_PIN, gpiochip);
+            return PTR_ERR(sw_gpiod);
+        }
+    }
+    sw_level = sw_read_level();
+
+    // 立ち上がりと立ち下がりの両方で割り込みを受ける
+    // 割り込み番号はGPIOコントローラから引く(疑似レジスタのときはsim_gplev0への書き込みで検出する)
+    if (!sim) {
+        sw_irq = gpiod_to_irq(sw_gpiod);
+        if (sw_irq < 0) {
+            dev_err(&pdev->dev, "failed to get IRQ of GPIO %d of %s.\n", SW_PIN, gpiochip);
+            return sw_irq;
+        }
+        ret = request_irq(sw_irq, sw_irq_handler, IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING, DEV_NAME, NULL);
+        if (ret != 0) {
+            dev_err(&pdev->dev, "failed to request IRQ %d.\n", sw_irq);
+            sw_irq = -1;
+            return ret;
+        }
+    }
 
     // デバイスファイルを作成する
     dev = device_create(&sw_class, NULL, MKDEV(SW_MAJOR_NUM, 0), NULL, DEV_NAME);
     if (IS_ERR(dev)) {
         dev_err(&pdev->dev, "faisw to create device.\n");
+        if (sw_irq >= 0) {
+            free_irq(sw_irq, NULL);
+            sw_irq = -1;
+        }
         return PTR_ERR(dev);
     }
-    iounmap((void*)gpio);
-    release_mem_region(GPIO_BASE_ADDR, MEM_SIZE);
     return 0;
 }
 
@@ -134,6 +450,13 @@ static int sw_remove(struct platform_device *pdev)
     // デバイスファイルを削除する
     device_destroy(&sw_class, MKDEV(SW_MAJOR_NUM, 0));
 
+    // 割り込みを止めてからチャタリング除去のタイマを止める
+    if (sw_irq >= 0) {
+        free_irq(sw_irq, NULL);
+        sw_irq = -1;
+    }
+    hrtimer_cancel(&sw_debounce_timer);
+
     return 0;
 }
 
@@ -156,9 +479,21 @@ static int __init sw_init(void)
     int ret = 0;
     printk("SW Init\n");
 
+    // probeより前に疑似レジスタに切り替えておく
+    if (sim) {
+        static_branch_enable(&sw_sim_key);
+    }
+    hrtimer_init(&sw_debounce_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    sw_debounce_timer.function = sw_debounce_fn;
+
+    // probeでSWのピンを引けるようにしておく
+    sw_gpio_table.table[0].key = gpiochip;
+    gpiod_add_lookup_table(&sw_gpio_table);
+
     // クラスの登録
     ret = class_register(&sw_class);
     if (ret != 0) {
+        gpiod_remove_lookup_table(&sw_gpio_table);
         return ret;
     }
     printk("SW Init: class_register OK\n");
@@ -168,6 +503,7 @@ static int __init sw_init(void)
     if (ret != 0) {
         printk("SW Init: platform_driver_register is err %d\n", ret);
         class_unregister(&sw_class);
+        gpiod_remove_lookup_table(&sw_gpio_table);
         return ret;
     }
     printk("SW Init: platform_driver_register OK\n");
@@ -177,19 +513,32 @@ static int __init sw_init(void)
     if (ret != 0) {
         printk("SW Init: register_chrdev is err %d\n", ret);
         platform_driver_unregister(&sw_driver);
+        class_unregister(&sw_class);
+        gpiod_remove_lookup_table(&sw_gpio_table);
         return ret;
     }
     printk("SW Init: register_chrdev OK\n");
 
     // プラットフォームバスにデバイスを登録
     pdev = platform_device_register_simple(DEV_NAME, -1, NULL, 0);
-    if (!pdev) {
-        printk("SKLE Init: platform_device_register_simple is err %d\n", ret);
+    if (IS_ERR(pdev)) {
+        ret = PTR_ERR(pdev);
+        printk("SW Init: platform_device_register_simple is err %d\n", ret);
         unregister_chrdev(SW_MAJOR_NUM, "sw");
-        return -1;
+        platform_driver_unregister(&sw_driver);
+        class_unregister(&sw_class);
+        gpiod_remove_lookup_table(&sw_gpio_table);
+        return ret;
     }
     printk("SW Init: platform_device_register_simple is OK\n");
 
+    // debugfsに統計のファイルを作る
+    sw_debugfs = debugfs_create_dir(DEV_NAME, NULL);
+    debugfs_create_file("stats", 0600, sw_debugfs, NULL, &sw_stats_fops);
+    if (sim) {  // 疑似レジスタのGPLEV0に書き込んでSWの入力を変えられる
+        debugfs_create_file_unsafe("sim_gplev0", 0644, sw_debugfs, NULL, &sw_sim_lev_fops);
+    }
+
     return ret;
 }
 
@@ -197,10 +546,12 @@ static int __init sw_init(void)
 static void __exit sw_exit(void)
 {
     printk("SW Exit\n");
+    debugfs_remove(sw_debugfs); // debugfsのディレクトリを削除
     platform_device_unregister(pdev);   // プラットフォームバスからデバイスの登録を解除
     unregister_chrdev(SW_MAJOR_NUM, DEV_NAME);  // キャラクタ登録を解除
     platform_driver_unregister(&sw_driver);   // プラットフォームバスからドライバの登録を解除
     class_unregister(&sw_class);  // クラス登録の解除
+    gpiod_remove_lookup_table(&sw_gpio_table);  // SWのピンの対応を削除
 }
 
 module_init(sw_init);
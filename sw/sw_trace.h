@@ -0,0 +1,71 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM sw
+
+#if !defined(_SW_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _SW_TRACE_H
+
+#include <linux/tracepoint.h>
+
+// open/release
+DECLARE_EVENT_CLASS(sw_file,
+    TP_PROTO(unsigned int minor),
+    TP_ARGS(minor),
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+    ),
+    TP_fast_assign(
+        __entry->minor = minor;
+    ),
+    TP_printk("minor=%u", __entry->minor)
+);
+
+DEFINE_EVENT(sw_file, sw_open,
+    TP_PROTO(unsigned int minor),
+    TP_ARGS(minor)
+);
+
+DEFINE_EVENT(sw_file, sw_release,
+    TP_PROTO(unsigned int minor),
+    TP_ARGS(minor)
+);
+
+// read: 読み取ったSWの状態
+TRACE_EVENT(sw_read,
+    TP_PROTO(unsigned int pin, int val, size_t count, loff_t pos),
+    TP_ARGS(pin, val, count, pos),
+    TP_STRUCT__entry(
+        __field(unsigned int, pin)
+        __field(int, val)
+        __field(size_t, count)
+        __field(loff_t, pos)
+    ),
+    TP_fast_assign(
+        __entry->pin = pin;
+        __entry->val = val;
+        __entry->count = count;
+        __entry->pos = pos;
+    ),
+    TP_printk("pin=%u val=%d count=%zu pos=%lld",
+              __entry->pin, __entry->val, __entry->count, __entry->pos)
+);
+
+// write
+TRACE_EVENT(sw_write,
+    TP_PROTO(size_t count),
+    TP_ARGS(count),
+    TP_STRUCT__entry(
+        __field(size_t, count)
+    ),
+    TP_fast_assign(
+        __entry->count = count;
+    ),
+    TP_printk("count=%zu", __entry->count)
+);
+
+#endif
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE sw_trace
+#include <trace/define_trace.h>
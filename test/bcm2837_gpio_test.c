@@ -0,0 +1,101 @@
+#include <kunit/test.h>
+#include <linux/module.h>
+#include <linux/ktime.h>
+
+#include "bcm2837_gpio.h"
+
+// led/sw共通のbcm2837_gpio.hのKUnitテスト
+// レジスタのオフセットと値の計算を確かめ、メモリ上の疑似レジスタで更新の所要時間を計測する
+// 実際のレジスタには触れないので、UMLやx86のQEMUでも実行できる
+
+#define GPIO_BENCH_ROUNDS 10000     // 計測で全ピンを更新する回数
+
+// GPFSELnは10ピンごとに1レジスタで、1ピンあたり3ビット
+static void gpio_test_fsel(struct kunit *test)
+{
+    KUNIT_EXPECT_EQ(test, gpio_fsel_reg(0), GPFSEL0);
+    KUNIT_EXPECT_EQ(test, gpio_fsel_reg(9), GPFSEL0);
+    KUNIT_EXPECT_EQ(test, gpio_fsel_reg(10), GPFSEL0 + 4);
+    KUNIT_EXPECT_EQ(test, gpio_fsel_reg(18), GPFSEL0 + 4);
+    KUNIT_EXPECT_EQ(test, gpio_fsel_reg(GPIO_NR_PINS - 1), GPFSEL0 + 0x14);
+
+    // 対象のピンの3ビットだけが書き換わる
+    KUNIT_EXPECT_EQ(test, gpio_fsel_val(U32_MAX, 18, GPIO_FSEL_OUTPUT), U32_MAX & ~(6U << 24));
+    KUNIT_EXPECT_EQ(test, gpio_fsel_val(U32_MAX, 10, GPIO_FSEL_INPUT), U32_MAX & ~7U);
+    KUNIT_EXPECT_EQ(test, gpio_fsel_val(0, 9, GPIO_FSEL_OUTPUT), 1U << 27);
+    KUNIT_EXPECT_EQ(test, gpio_fsel_val(0, 0, GPIO_FSEL_MASK), GPIO_FSEL_MASK);
+}
+
+// GPSETn/GPCLRn/GPLEVnは32ピンごとに1レジスタで、1ピンあたり1ビット
+static void gpio_test_bits(struct kunit *test)
+{
+    KUNIT_EXPECT_EQ(test, gpio_set_reg(17), GPSET0);
+    KUNIT_EXPECT_EQ(test, gpio_set_reg(32), GPSET0 + 4);
+    KUNIT_EXPECT_EQ(test, gpio_clr_reg(31), GPCLR0);
+    KUNIT_EXPECT_EQ(test, gpio_clr_reg(GPIO_NR_PINS - 1), GPCLR0 + 4);
+    KUNIT_EXPECT_EQ(test, gpio_lev_reg(18), GPLEV0);
+    KUNIT_EXPECT_EQ(test, gpio_lev_reg(33), GPLEV0 + 4);
+
+    KUNIT_EXPECT_EQ(test, gpio_pin_bit(0), 1U);
+    KUNIT_EXPECT_EQ(test, gpio_pin_bit(31), 1U << 31);
+    KUNIT_EXPECT_EQ(test, gpio_pin_bit(33), 1U << 1);
+
+    KUNIT_EXPECT_TRUE(test, gpio_level(1U << 18, 18));
+    KUNIT_EXPECT_FALSE(test, gpio_level(~(1U << 18), 18));
+    KUNIT_EXPECT_TRUE(test, gpio_level(1U << 1, 33));
+}
+
+// 全ピンを出力にして点灯/消灯したときの疑似レジスタの中身
+static void gpio_test_update(struct kunit *test)
+{
+    u32 regs[MEM_SIZE / 4] = { 0 };
+    unsigned int pin;
+
+    for (pin = 0; pin < GPIO_NR_PINS; pin++) {
+        regs[gpio_fsel_reg(pin) / 4] = gpio_fsel_val(regs[gpio_fsel_reg(pin) / 4], pin, GPIO_FSEL_OUTPUT);
+        regs[gpio_set_reg(pin) / 4] |= gpio_pin_bit(pin);
+        regs[gpio_clr_reg(pin) / 4] |= gpio_pin_bit(pin);
+    }
+    KUNIT_EXPECT_EQ(test, regs[GPFSEL0 / 4], 01111111111U);    // 10ピン分の001
+    KUNIT_EXPECT_EQ(test, regs[(GPFSEL0 + 0x14) / 4], 01111U);  // 50-53番ピンの4ピン分
+    KUNIT_EXPECT_EQ(test, regs[GPSET0 / 4], U32_MAX);
+    KUNIT_EXPECT_EQ(test, regs[GPSET0 / 4 + 1], (1U << (GPIO_NR_PINS - 32)) - 1);
+    KUNIT_EXPECT_EQ(test, regs[GPCLR0 / 4 + 1], (1U << (GPIO_NR_PINS - 32)) - 1);
+}
+
+// 疑似レジスタでの機能選択と点灯/消灯の更新の所要時間を計測する
+static void gpio_test_bench_update(struct kunit *test)
+{
+    static u32 regs[MEM_SIZE / 4];
+    unsigned int pin, r;
+    u64 start, ns;
+
+    start = ktime_get_ns();
+    for (r = 0; r < GPIO_BENCH_ROUNDS; r++) {
+        for (pin = 0; pin < GPIO_NR_PINS; pin++) {
+            WRITE_ONCE(regs[gpio_fsel_reg(pin) / 4],
+                       gpio_fsel_val(READ_ONCE(regs[gpio_fsel_reg(pin) / 4]), pin, GPIO_FSEL_OUTPUT));
+            WRITE_ONCE(regs[(r & 1 ? gpio_clr_reg(pin) : gpio_set_reg(pin)) / 4], gpio_pin_bit(pin));
+        }
+    }
+    ns = ktime_get_ns() - start;
+    kunit_info(test, "fsel+set/clr update: %llu ns/pin (%u pins x %u rounds)\n",
+               div_u64(ns, GPIO_NR_PINS * GPIO_BENCH_ROUNDS), GPIO_NR_PINS, GPIO_BENCH_ROUNDS);
+}
+
+static struct kunit_case gpio_test_cases[] = {
+    KUNIT_CASE(gpio_test_fsel),
+    KUNIT_CASE(gpio_test_bits),
+    KUNIT_CASE(gpio_test_update),
+    KUNIT_CASE(gpio_test_bench_update),
+    {}
+};
+
+static struct kunit_suite gpio_test_suite = {
+    .name = "bcm2837_gpio",
+    .test_cases = gpio_test_cases,
+};
+kunit_test_suite(gpio_test_suite);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("KUnit tests for the BCM2837 GPIO helpers");